@@ -0,0 +1,252 @@
+#include "libcoro.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+/**
+ * Microbenchmarks of the coroutine library. Build it with each
+ * context switch backend to compare them:
+ *
+ * $> make bench
+ */
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static long
+minor_faults(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_minflt;
+}
+
+static int
+coro_empty_f(void *arg)
+{
+	(void)arg;
+	return 0;
+}
+
+static int
+coro_yield_f(void *arg)
+{
+	int count = *(int *)arg;
+	for (int i = 0; i < count; ++i)
+		coro_yield();
+	return 0;
+}
+
+/**
+ * Coroutines yielding a few times and finishing in an order not
+ * matching the one of creation.
+ */
+static int
+coro_yield_random_f(void *arg)
+{
+	int count = (int)(long)arg;
+	for (int i = 0; i < count; ++i)
+		coro_yield();
+	return 0;
+}
+
+static void
+bench_create(int count, int batch)
+{
+	struct coro **coros = malloc(sizeof(*coros) * batch);
+	double total = 0;
+	long faults = minor_faults();
+	for (int done = 0; done < count; done += batch) {
+		double start = now_ns();
+		for (int i = 0; i < batch; ++i)
+			coros[i] = coro_new(coro_empty_f, NULL);
+		total += now_ns() - start;
+		struct coro *c;
+		while ((c = coro_sched_wait()) != NULL)
+			coro_delete(c);
+	}
+	free(coros);
+	faults = minor_faults() - faults;
+	printf("create: %.1f ns, %.2f page faults\n", total / count,
+	       (double)faults / count);
+}
+
+static void
+bench_yield(int count, bool is_profiling)
+{
+	coro_sched_set_profiling(is_profiling);
+	int per_coro = count / 2;
+	coro_new(coro_yield_f, &per_coro);
+	coro_new(coro_yield_f, &per_coro);
+	double start = now_ns();
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	coro_sched_set_profiling(false);
+	printf("yield%s: %.1f ns\n", is_profiling ? " with profiling" : "",
+	       (now_ns() - start) / count);
+}
+
+static int
+coro_quantum_check_f(void *arg)
+{
+	long count = *(long *)arg;
+	coro_set_quantum(1000000);
+	double start = now_ns();
+	long yields = 0;
+	for (long i = 0; i < count; ++i)
+		yields += coro_yield_if_expired();
+	double check = (now_ns() - start) / count;
+	struct timespec ts;
+	start = now_ns();
+	for (long i = 0; i < count; ++i)
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+	printf("quantum check: %.1f ns, clock_gettime: %.1f ns\n", check,
+	       (now_ns() - start) / count);
+	return yields;
+}
+
+/** What solution.c paid per merge step before and what it pays now. */
+static void
+bench_quantum_check(long count)
+{
+	coro_new(coro_quantum_check_f, &count);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+}
+
+static void
+bench_reap(int count)
+{
+	struct coro_attr attr;
+	coro_attr_init(&attr);
+	attr.stack_size = 16 * 1024;
+	/* Too many coroutines at once to have a guard page each. */
+	coro_stack_pool_configure(0, false, false);
+	srand(1);
+	for (int i = 0; i < count; ++i)
+		coro_new_ex(coro_yield_random_f, (void *)(long)(rand() % 4), &attr);
+	double start = now_ns();
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	printf("reap %d: %.1f ms\n", count, (now_ns() - start) / 1e6);
+	coro_stack_pool_configure(1024, false, true);
+}
+
+/** CPU-bound coroutine, yielding every now and then. */
+static int
+coro_cpu_f(void *arg)
+{
+	volatile unsigned *result = arg;
+	unsigned x = 1;
+	for (int i = 0; i < 100; ++i) {
+		for (int j = 0; j < 100000; ++j)
+			x = x * 1103515245 + 12345;
+		coro_yield();
+	}
+	*result = x;
+	return 0;
+}
+
+static void
+bench_mt(int threads)
+{
+	enum { CORO_COUNT = 64 };
+	unsigned results[CORO_COUNT];
+	if (threads > 0 && coro_sched_start_workers(threads) != 0)
+		abort();
+	double start = now_ns();
+	for (int i = 0; i < CORO_COUNT; ++i)
+		coro_new(coro_cpu_f, &results[i]);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	double duration = now_ns() - start;
+	coro_sched_stop_workers();
+	printf("cpu-bound, %d workers: %.1f ms\n", threads,
+	       duration / 1e6);
+}
+
+struct ping_pong {
+	struct coro_channel *ping;
+	struct coro_channel *pong;
+	long count;
+};
+
+static int
+coro_ping_f(void *arg)
+{
+	struct ping_pong *p = arg;
+	void *v;
+	for (long i = 0; i < p->count; ++i) {
+		coro_channel_send(p->ping, (void *)i);
+		coro_channel_recv(p->pong, &v);
+	}
+	coro_channel_close(p->ping);
+	return 0;
+}
+
+static int
+coro_pong_f(void *arg)
+{
+	struct ping_pong *p = arg;
+	void *v;
+	while (coro_channel_recv(p->ping, &v) == 0)
+		coro_channel_send(p->pong, v);
+	return 0;
+}
+
+/** A message goes back and forth via two unbuffered channels. */
+static void
+bench_ping_pong(long count, int threads)
+{
+	if (threads > 0 && coro_sched_start_workers(threads) != 0)
+		abort();
+	struct ping_pong p = {coro_channel_new(0), coro_channel_new(0),
+			      count};
+	double start = now_ns();
+	coro_new(coro_ping_f, &p);
+	coro_new(coro_pong_f, &p);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	double duration = now_ns() - start;
+	coro_sched_stop_workers();
+	coro_channel_delete(p.ping);
+	coro_channel_delete(p.pong);
+	printf("channel ping-pong, %d workers: %.0f handoffs/sec\n", threads,
+	       2 * count / (duration / 1e9));
+}
+
+int
+main(int argc, char **argv)
+{
+	int count = argc > 1 ? atoi(argv[1]) : 100000;
+	coro_sched_init();
+	bench_create(count, 1000);
+	bench_yield(count * 10, false);
+	bench_yield(count, true);
+	bench_quantum_check(count * 100L);
+	bench_reap(count);
+	bench_mt(0);
+	int cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	for (int threads = 1; threads <= cpu_count; threads *= 2)
+		bench_mt(threads);
+	bench_ping_pong(count * 10, 0);
+	bench_ping_pong(count, 1);
+	struct coro_stack_pool_stats stats;
+	coro_stack_pool_stats(&stats);
+	printf("stack pool: %lld hits, %lld misses\n", stats.hits,
+	       stats.misses);
+	return 0;
+}
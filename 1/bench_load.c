@@ -0,0 +1,117 @@
+#include "intfile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/**
+ * Throughput of the loaders of the sort input files: the old
+ * double fscanf() pass against the one pass chunked parser. And
+ * of the result writers: fprintf() per number against the batched
+ * one.
+ *
+ * $> make bench_load
+ */
+
+static double
+now_s(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** The loader solution.c used to have. */
+static int *
+load_fscanf(const char *path, size_t *size)
+{
+	FILE *f = fopen(path, "r");
+	*size = 0;
+	for (int next; fscanf(f, "%d", &next) != EOF;)
+		++*size;
+	int *arr = malloc(sizeof(int) * *size);
+	fseek(f, 0, SEEK_SET);
+	for (size_t i = 0; fscanf(f, "%d", &arr[i]) != EOF; ++i)
+		;
+	fclose(f);
+	return arr;
+}
+
+/** The writer solution.c used to have. */
+static void
+store_fprintf(const char *path, const int *data, size_t size)
+{
+	FILE *f = fopen(path, "w");
+	for (size_t i = 0; i < size; ++i)
+		fprintf(f, "%d ", data[i]);
+	fclose(f);
+}
+
+static void
+bench_store(const char *path, const int *data, size_t size, double mb)
+{
+	double start = now_s();
+	store_fprintf(path, data, size);
+	double old_time = now_s() - start;
+	printf("fprintf: %.1f MB/s\n", mb / old_time);
+
+	start = now_s();
+	if (intfile_write(path, data, size, INTFILE_TEXT) != 0)
+		abort();
+	double new_time = now_s() - start;
+	printf("batched text: %.1f MB/s, %.1fx\n", mb / new_time,
+	       old_time / new_time);
+
+	start = now_s();
+	if (intfile_write(path, data, size, INTFILE_BINARY) != 0)
+		abort();
+	double bin_time = now_s() - start;
+	printf("binary: %.1f ms, text was %.1f ms\n", bin_time * 1000,
+	       new_time * 1000);
+}
+
+int
+main(int argc, char **argv)
+{
+	long count = argc > 1 ? atol(argv[1]) : 5000000;
+	char path[] = "/tmp/bench_load_XXXXXX";
+	int fd = mkstemp(path);
+	FILE *f = fdopen(fd, "w");
+	srand(1);
+	for (long i = 0; i < count; ++i)
+		fprintf(f, "%d ", rand());
+	fclose(f);
+	struct stat st;
+	stat(path, &st);
+	double mb = st.st_size / 1e6;
+	printf("%ld numbers, %.1f MB\n", count, mb);
+
+	double start = now_s();
+	size_t old_size;
+	int *old = load_fscanf(path, &old_size);
+	double old_time = now_s() - start;
+	printf("fscanf x2: %.1f MB/s\n", mb / old_time);
+
+	start = now_s();
+	struct int_array arr;
+	int_array_create(&arr);
+	if (intfile_read(path, &arr) != 0)
+		abort();
+	double new_time = now_s() - start;
+	printf("chunked parser: %.1f MB/s, %.1fx\n", mb / new_time,
+	       old_time / new_time);
+
+	if (arr.size != old_size ||
+	    memcmp(arr.data, old, old_size * sizeof(int)) != 0) {
+		printf("the loaders disagree\n");
+		return 1;
+	}
+	free(old);
+	bench_store(path, arr.data, arr.size, mb);
+	int_array_destroy(&arr);
+	unlink(path);
+	return 0;
+}
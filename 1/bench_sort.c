@@ -0,0 +1,251 @@
+#include "sort.h"
+#include "pmerge.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * The per-file sort of solution.c: the old top-down merge sort,
+ * which allocates a buffer for each merge, against the bottom-up
+ * one with a single scratch buffer. Then all the engines of
+ * --algo on the inputs of different sizes and value ranges, like
+ * generator.py makes with -c and -m. At last the final merge of
+ * the sorted files: chained pairwise against the K-way one, and
+ * the parallel merge and write of the result by the threads.
+ *
+ * $> make bench_sort
+ */
+
+static long alloc_count;
+
+static double
+now_s(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** The merge solution.c used to have. */
+static void
+old_merge(int *arr, int l, int r)
+{
+	int mid = (l + r) / 2;
+	int p1 = l, p2 = mid + 1, pos = 0;
+	int *answer = malloc((r - l + 1) * sizeof(int));
+	++alloc_count;
+	while (p1 <= mid || p2 <= r) {
+		if (p1 > mid)
+			answer[pos++] = arr[p2++];
+		else if (p2 > r)
+			answer[pos++] = arr[p1++];
+		else if (arr[p1] < arr[p2])
+			answer[pos++] = arr[p1++];
+		else
+			answer[pos++] = arr[p2++];
+	}
+	memcpy(&arr[l], answer, (r - l + 1) * sizeof(int));
+	free(answer);
+}
+
+static void
+old_sort(int *arr, int l, int r)
+{
+	if (l == r)
+		return;
+	int mid = (l + r) / 2;
+	old_sort(arr, l, mid);
+	old_sort(arr, mid + 1, r);
+	old_merge(arr, l, r);
+}
+
+static bool
+yield_never(void *arg)
+{
+	(void)arg;
+	return false;
+}
+
+/** Milliseconds to sort @a size random numbers in [0, max]. */
+static double
+bench_engine(sort_f sort, int size, long max)
+{
+	int *arr = malloc(size * sizeof(int));
+	int *scratch = malloc(size * sizeof(int));
+	srand(size);
+	for (int i = 0; i < size; ++i)
+		arr[i] = rand() % (max + 1);
+	double start = now_s();
+	sort(arr, size, scratch, yield_never, NULL);
+	double duration = now_s() - start;
+	for (int i = 1; i < size; ++i) {
+		if (arr[i - 1] > arr[i])
+			abort();
+	}
+	free(arr);
+	free(scratch);
+	return duration * 1000;
+}
+
+static void
+bench_engines(int max_size)
+{
+	const char *names[] = {"merge", "radix", "hybrid"};
+	long maxes[] = {1000, 1000000, (1L << 31) - 1};
+	printf("\n%10s %11s %10s %10s %10s\n", "count", "max", "merge ms",
+	       "radix ms", "hybrid ms");
+	for (int size = 10000; size <= max_size; size *= 10) {
+		for (int m = 0; m < 3; ++m) {
+			printf("%10d %11ld", size, maxes[m]);
+			for (int e = 0; e < 3; ++e) {
+				sort_f sort = sort_by_name(names[e]);
+				printf(" %10.2f",
+				       bench_engine(sort, size, maxes[m]));
+			}
+			printf("\n");
+		}
+	}
+}
+
+/** The chain of combine() calls solution.c used to have. */
+static int *
+old_combine_all(const struct sort_run *runs, int count, size_t *size)
+{
+	int *acc = malloc(runs[0].size * sizeof(int));
+	memcpy(acc, runs[0].data, runs[0].size * sizeof(int));
+	*size = runs[0].size;
+	for (int r = 1; r < count; ++r) {
+		size_t new_size = *size + runs[r].size;
+		int *arr = malloc(new_size * sizeof(int));
+		size_t i = 0, j = 0, k = 0;
+		while (i < *size || j < runs[r].size) {
+			if (i == *size)
+				arr[k++] = runs[r].data[j++];
+			else if (j == runs[r].size)
+				arr[k++] = acc[i++];
+			else if (acc[i] < runs[r].data[j])
+				arr[k++] = acc[i++];
+			else
+				arr[k++] = runs[r].data[j++];
+		}
+		free(acc);
+		acc = arr;
+		*size = new_size;
+	}
+	return acc;
+}
+
+static void
+bench_merge_k(int count, int run_size)
+{
+	struct sort_run *runs = malloc(count * sizeof(*runs));
+	int *data = malloc((size_t)count * run_size * sizeof(int));
+	int *scratch = malloc(run_size * sizeof(int));
+	srand(count);
+	for (int r = 0; r < count; ++r) {
+		int *run = &data[(size_t)r * run_size];
+		for (int i = 0; i < run_size; ++i)
+			run[i] = rand();
+		sort_radix(run, run_size, scratch, yield_never, NULL);
+		runs[r] = (struct sort_run){run, run_size};
+	}
+	double start = now_s();
+	size_t size;
+	int *old = old_combine_all(runs, count, &size);
+	double old_time = now_s() - start;
+	int *out = malloc(size * sizeof(int));
+	start = now_s();
+	sort_merge_k(runs, count, out);
+	double new_time = now_s() - start;
+	if (memcmp(old, out, size * sizeof(int)) != 0)
+		abort();
+	printf("%5d files x %7d: chained %9.1f ms, k-way %7.1f ms, %.1fx\n",
+	       count, run_size, old_time * 1000, new_time * 1000,
+	       old_time / new_time);
+	free(old);
+	free(out);
+	free(data);
+	free(scratch);
+	free(runs);
+}
+
+static void
+bench_pmerge(int count, int run_size)
+{
+	struct sort_run *runs = malloc(count * sizeof(*runs));
+	int *data = malloc((size_t)count * run_size * sizeof(int));
+	int *scratch = malloc(run_size * sizeof(int));
+	srand(count);
+	for (int r = 0; r < count; ++r) {
+		int *run = &data[(size_t)r * run_size];
+		for (int i = 0; i < run_size; ++i)
+			run[i] = rand();
+		sort_radix(run, run_size, scratch, yield_never, NULL);
+		runs[r] = (struct sort_run){run, run_size};
+	}
+	char path[] = "/tmp/bench_pmerge_XXXXXX";
+	close(mkstemp(path));
+	double base = 0;
+	for (int threads = 1; threads <= 16; threads *= 2) {
+		double start = now_s();
+		if (pmerge_write(runs, count, threads, path, INTFILE_TEXT) != 0)
+			abort();
+		double time = now_s() - start;
+		if (threads == 1)
+			base = time;
+		printf("%2d threads: merge and write %7.1f ms, %.1fx\n",
+		       threads, time * 1000, base / time);
+	}
+	unlink(path);
+	free(data);
+	free(scratch);
+	free(runs);
+}
+
+int
+main(int argc, char **argv)
+{
+	int size = argc > 1 ? atoi(argv[1]) : 1000000;
+	int *data = malloc(size * sizeof(int));
+	int *old = malloc(size * sizeof(int));
+	int *arr = malloc(size * sizeof(int));
+	srand(1);
+	for (int i = 0; i < size; ++i)
+		data[i] = rand();
+	printf("%d numbers\n", size);
+
+	memcpy(old, data, size * sizeof(int));
+	double start = now_s();
+	old_sort(old, 0, size - 1);
+	double old_time = now_s() - start;
+	printf("top-down, malloc per merge: %.1f ms, %ld allocations\n",
+	       old_time * 1000, alloc_count);
+
+	memcpy(arr, data, size * sizeof(int));
+	start = now_s();
+	int *scratch = malloc(size * sizeof(int));
+	sort_merge(arr, size, scratch, yield_never, NULL);
+	free(scratch);
+	double new_time = now_s() - start;
+	printf("bottom-up, one scratch buffer: %.1f ms, 1 allocation, "
+	       "%.1fx\n", new_time * 1000, old_time / new_time);
+
+	if (memcmp(old, arr, size * sizeof(int)) != 0) {
+		printf("the sorts disagree\n");
+		return 1;
+	}
+	free(data);
+	free(old);
+	free(arr);
+	bench_engines(size);
+	printf("\n");
+	bench_merge_k(10, size / 10);
+	bench_merge_k(100, size / 100);
+	bench_merge_k(1000, size / 1000);
+	printf("\n");
+	bench_pmerge(16, size / 16);
+	return 0;
+}
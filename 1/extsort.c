@@ -0,0 +1,354 @@
+#include "extsort.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+void
+extsort_reader_create(struct extsort_reader *r, const char *const *paths,
+		      int path_count)
+{
+	r->paths = paths;
+	r->path_count = path_count;
+	r->next_path = 0;
+	r->fd = -1;
+	int_parser_create(&r->parser);
+	r->buf = malloc(EXTSORT_READ_CHUNK);
+	if (r->buf == NULL)
+		abort();
+	r->pos = 0;
+	r->size = 0;
+}
+
+void
+extsort_reader_destroy(struct extsort_reader *r)
+{
+	if (r->fd >= 0)
+		close(r->fd);
+	free(r->buf);
+}
+
+int
+extsort_reader_fill(struct extsort_reader *r, struct int_array *arr)
+{
+	arr->size = 0;
+	while (true) {
+		if (r->pos == r->size) {
+			if (r->fd < 0) {
+				if (r->next_path == r->path_count)
+					return 0;
+				r->fd = open(r->paths[r->next_path++], O_RDONLY);
+				if (r->fd < 0)
+					return -1;
+			}
+			ssize_t size = read(r->fd, r->buf, EXTSORT_READ_CHUNK);
+			if (size < 0) {
+				if (errno == EINTR)
+					continue;
+				return -1;
+			}
+			if (size == 0) {
+				int_parser_finish(&r->parser, arr);
+				close(r->fd);
+				r->fd = -1;
+				continue;
+			}
+			r->pos = 0;
+			r->size = size;
+		}
+		/*
+		 * N bytes complete at most N / 2 numbers after the
+		 * unfinished one. It all should fit into the array,
+		 * the parser would grow it otherwise.
+		 */
+		size_t room = arr->capacity - arr->size;
+		if (room < 2)
+			return 0;
+		size_t len = r->size - r->pos;
+		if (len > 2 * room - 3)
+			len = 2 * room - 3;
+		int_parser_feed(&r->parser, r->buf + r->pos, len, arr);
+		r->pos += len;
+	}
+}
+
+/** An unlinked temporary file, gone with its descriptor. */
+static int
+extsort_tmpfile(void)
+{
+	const char *dir = getenv("TMPDIR");
+	if (dir == NULL || *dir == 0)
+		dir = "/tmp";
+	char path[PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s/extsort_XXXXXX", dir) >=
+	    (int)sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	int fd = mkstemp(path);
+	if (fd < 0)
+		return -1;
+	unlink(path);
+	return fd;
+}
+
+int
+extsort_run_spill(const int *data, size_t size, struct extsort_run *run)
+{
+	int fd = extsort_tmpfile();
+	if (fd < 0)
+		return -1;
+	struct intfile_writer w;
+	intfile_writer_create(&w, fd, INTFILE_BINARY);
+	int rc = intfile_writer_put(&w, data, size);
+	if (rc == 0)
+		rc = intfile_writer_flush(&w);
+	intfile_writer_destroy(&w);
+	if (rc != 0) {
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return -1;
+	}
+	run->fd = fd;
+	run->size = size;
+	return 0;
+}
+
+void
+extsort_run_delete(struct extsort_run *run)
+{
+	if (run->fd >= 0)
+		close(run->fd);
+	run->fd = -1;
+	run->size = 0;
+}
+
+/** Read position in a run with its read-ahead buffer. */
+struct extsort_cursor {
+	const int *pos;
+	const int *end;
+	int *buf;
+	size_t capacity;
+	int fd;
+	off_t offset;
+	/** Numbers in the file after the buffer. */
+	size_t left;
+};
+
+static int
+extsort_cursor_refill(struct extsort_cursor *c)
+{
+	size_t count = c->left < c->capacity ? c->left : c->capacity;
+	char *pos = (char *)c->buf;
+	size_t size = count * sizeof(int);
+	while (size > 0) {
+		ssize_t rc = pread(c->fd, pos, size, c->offset);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (rc == 0) {
+			/* The run file is shorter than it was written. */
+			errno = EIO;
+			return -1;
+		}
+		pos += rc;
+		size -= rc;
+		c->offset += rc;
+	}
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+	for (size_t i = 0; i < count; ++i)
+		c->buf[i] = __builtin_bswap32(c->buf[i]);
+#endif
+	c->pos = c->buf;
+	c->end = c->buf + count;
+	c->left -= count;
+	return 0;
+}
+
+static void
+extsort_heap_sift_down(struct extsort_cursor **heap, int size, int i)
+{
+	struct extsort_cursor *node = heap[i];
+	while (true) {
+		int child = 2 * i + 1;
+		if (child >= size)
+			break;
+		if (child + 1 < size &&
+		    *heap[child + 1]->pos < *heap[child]->pos)
+			++child;
+		if (*node->pos <= *heap[child]->pos)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = node;
+}
+
+/**
+ * One merge of all the runs into @a out. Each run gets a buffer
+ * of @a buf_size bytes, or less if the run is shorter.
+ */
+static int
+extsort_merge_pass(const struct extsort_run *runs, int count,
+		   size_t buf_size, struct intfile_writer *out)
+{
+	size_t total_capacity = 0;
+	for (int i = 0; i < count; ++i) {
+		size_t capacity = buf_size / sizeof(int);
+		total_capacity += runs[i].size < capacity ? runs[i].size :
+							    capacity;
+	}
+	struct extsort_cursor *cursors = malloc(sizeof(*cursors) * count);
+	struct extsort_cursor **heap = malloc(sizeof(*heap) * (count + 1));
+	int *bufs = malloc(sizeof(int) * (total_capacity + 1));
+	int *merged = malloc(EXTSORT_OUT_BUF);
+	if (cursors == NULL || heap == NULL || bufs == NULL || merged == NULL)
+		abort();
+	const size_t merged_capacity = EXTSORT_OUT_BUF / sizeof(int);
+	size_t merged_size = 0;
+	int rc = 0;
+	int size = 0;
+	int *buf = bufs;
+	for (int i = 0; i < count; ++i) {
+		if (runs[i].size == 0)
+			continue;
+		struct extsort_cursor *c = &cursors[i];
+		c->capacity = buf_size / sizeof(int);
+		if (c->capacity > runs[i].size)
+			c->capacity = runs[i].size;
+		c->buf = buf;
+		buf += c->capacity;
+		c->fd = runs[i].fd;
+		c->offset = 0;
+		c->left = runs[i].size;
+		if ((rc = extsort_cursor_refill(c)) != 0)
+			goto out;
+		heap[size++] = c;
+	}
+	for (int i = size / 2 - 1; i >= 0; --i)
+		extsort_heap_sift_down(heap, size, i);
+	while (size > 1) {
+		struct extsort_cursor *top = heap[0];
+		merged[merged_size++] = *top->pos++;
+		if (merged_size == merged_capacity) {
+			rc = intfile_writer_put(out, merged, merged_size);
+			if (rc != 0)
+				goto out;
+			merged_size = 0;
+		}
+		if (top->pos == top->end) {
+			if (top->left == 0)
+				heap[0] = heap[--size];
+			else if ((rc = extsort_cursor_refill(top)) != 0)
+				goto out;
+		}
+		extsort_heap_sift_down(heap, size, 0);
+	}
+	if (merged_size > 0 &&
+	    (rc = intfile_writer_put(out, merged, merged_size)) != 0)
+		goto out;
+	/* The last run needs no comparisons, only the buffers. */
+	if (size == 1) {
+		struct extsort_cursor *c = heap[0];
+		while (true) {
+			rc = intfile_writer_put(out, c->pos, c->end - c->pos);
+			if (rc != 0 || c->left == 0)
+				break;
+			if ((rc = extsort_cursor_refill(c)) != 0)
+				break;
+		}
+	}
+out:
+	free(merged);
+	free(bufs);
+	free(heap);
+	free(cursors);
+	return rc;
+}
+
+/** Merge the runs into one new run. */
+static int
+extsort_merge_group(const struct extsort_run *runs, int count,
+		    size_t buf_size, struct extsort_run *result)
+{
+	int fd = extsort_tmpfile();
+	if (fd < 0)
+		return -1;
+	struct intfile_writer w;
+	intfile_writer_create(&w, fd, INTFILE_BINARY);
+	int rc = extsort_merge_pass(runs, count, buf_size, &w);
+	if (rc == 0)
+		rc = intfile_writer_flush(&w);
+	intfile_writer_destroy(&w);
+	if (rc != 0) {
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return -1;
+	}
+	result->fd = fd;
+	result->size = 0;
+	for (int i = 0; i < count; ++i)
+		result->size += runs[i].size;
+	return 0;
+}
+
+static void
+extsort_runs_delete(struct extsort_run *runs, int count)
+{
+	int saved_errno = errno;
+	for (int i = 0; i < count; ++i)
+		extsort_run_delete(&runs[i]);
+	errno = saved_errno;
+}
+
+int
+extsort_merge(struct extsort_run *runs, int count, size_t mem_limit,
+	      struct intfile_writer *out)
+{
+	if (mem_limit < EXTSORT_MERGE_MIN_MEM)
+		mem_limit = EXTSORT_MERGE_MIN_MEM;
+	size_t budget = mem_limit - EXTSORT_OUT_BUF - INTFILE_CHUNK_SIZE;
+	size_t max_fan_in = budget / EXTSORT_MIN_RUN_BUF;
+	int fan_in = max_fan_in > INT_MAX ? INT_MAX : (int)max_fan_in;
+	/* The runs of the previous pass, owned here. */
+	struct extsort_run *owned = NULL;
+	while (count > fan_in) {
+		int new_count = (count - 1) / fan_in + 1;
+		struct extsort_run *merged = malloc(sizeof(*merged) * new_count);
+		if (merged == NULL)
+			abort();
+		for (int i = 0; i < new_count; ++i) {
+			struct extsort_run *group = &runs[i * fan_in];
+			int size = count - i * fan_in;
+			if (size > fan_in)
+				size = fan_in;
+			if (extsort_merge_group(group, size, budget / size,
+						&merged[i]) != 0) {
+				extsort_runs_delete(group, count - i * fan_in);
+				extsort_runs_delete(merged, i);
+				free(merged);
+				free(owned);
+				return -1;
+			}
+			extsort_runs_delete(group, size);
+		}
+		free(owned);
+		owned = merged;
+		runs = merged;
+		count = new_count;
+	}
+	int rc = 0;
+	if (count > 0)
+		rc = extsort_merge_pass(runs, count, budget / count, out);
+	extsort_runs_delete(runs, count);
+	free(owned);
+	return rc;
+}
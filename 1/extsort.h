@@ -0,0 +1,93 @@
+#pragma once
+
+#include "intfile.h"
+
+/**
+ * External merge sort, for the inputs bigger than the memory. The
+ * input is cut into runs of a bounded size, each run is sorted and
+ * spilled into a temporary file, then all the runs are merged in
+ * one stream with a fixed read-ahead buffer per run.
+ */
+
+enum {
+	/** Text read buffer of the run reader. */
+	EXTSORT_READ_CHUNK = 64 * 1024,
+	/** Smallest read-ahead buffer of a run in the merge. */
+	EXTSORT_MIN_RUN_BUF = 64 * 1024,
+	/** Buffer of the merged numbers before the writer. */
+	EXTSORT_OUT_BUF = 64 * 1024,
+	/**
+	 * The least memory the merge works with: the output, the
+	 * writer and two runs. More runs are merged in several
+	 * passes then.
+	 */
+	EXTSORT_MERGE_MIN_MEM = EXTSORT_OUT_BUF + INTFILE_CHUNK_SIZE +
+				2 * EXTSORT_MIN_RUN_BUF,
+};
+
+/** Reader of the numbers of several text files, run by run. */
+struct extsort_reader {
+	const char *const *paths;
+	int path_count;
+	/** Index of the file to open next. */
+	int next_path;
+	/** The current file, -1 between the files. */
+	int fd;
+	struct int_parser parser;
+	char *buf;
+	/** Not parsed part of the buffer. */
+	size_t pos;
+	size_t size;
+};
+
+void
+extsort_reader_create(struct extsort_reader *r, const char *const *paths,
+		      int path_count);
+
+void
+extsort_reader_destroy(struct extsort_reader *r);
+
+/**
+ * Read the next run of numbers into @a arr. The run takes up to
+ * arr->capacity numbers, the array is never grown, so the memory
+ * is bounded by the caller. A number split by the end of the run
+ * goes to the next one.
+ * @retval 0 Success. An empty run means the end of the input.
+ * @retval -1 Error, errno is set.
+ */
+int
+extsort_reader_fill(struct extsort_reader *r, struct int_array *arr);
+
+/**
+ * A sorted run in an unlinked temporary file, as little-endian
+ * int32. The file is in $TMPDIR or /tmp.
+ */
+struct extsort_run {
+	int fd;
+	size_t size;
+};
+
+/**
+ * Write the sorted numbers into a new temporary file.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+extsort_run_spill(const int *data, size_t size, struct extsort_run *run);
+
+/** Close the file, it is gone then. */
+void
+extsort_run_delete(struct extsort_run *run);
+
+/**
+ * Merge the runs into @a out, which is not flushed. Read-ahead
+ * buffers of all the runs share @a mem_limit bytes, at least
+ * EXTSORT_MERGE_MIN_MEM. When the runs are too many for that, the
+ * groups of them are merged into the bigger runs first. The runs
+ * are deleted in any case.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+extsort_merge(struct extsort_run *runs, int count, size_t mem_limit,
+	      struct intfile_writer *out);
@@ -0,0 +1,401 @@
+#include "intfile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+enum {
+	INT_ARRAY_MIN_CAPACITY = 1024,
+};
+
+void
+int_array_create(struct int_array *arr)
+{
+	arr->data = NULL;
+	arr->size = 0;
+	arr->capacity = 0;
+}
+
+void
+int_array_destroy(struct int_array *arr)
+{
+	free(arr->data);
+}
+
+void
+int_array_reserve(struct int_array *arr, size_t count)
+{
+	size_t need = arr->size + count;
+	if (need <= arr->capacity)
+		return;
+	size_t capacity = arr->capacity;
+	if (capacity < INT_ARRAY_MIN_CAPACITY)
+		capacity = INT_ARRAY_MIN_CAPACITY;
+	while (capacity < need)
+		capacity *= 2;
+	int *data = realloc(arr->data, capacity * sizeof(*data));
+	if (data == NULL)
+		abort();
+	arr->data = data;
+	arr->capacity = capacity;
+}
+
+void
+int_parser_create(struct int_parser *p)
+{
+	p->value = 0;
+	p->is_negative = false;
+	p->in_number = false;
+}
+
+static inline void
+int_parser_push(struct int_parser *p, struct int_array *arr)
+{
+	if (arr->size == arr->capacity)
+		int_array_reserve(arr, 1);
+	long long v = p->is_negative ? -(long long)p->value :
+				       (long long)p->value;
+	arr->data[arr->size++] = (int)v;
+	p->value = 0;
+	p->is_negative = false;
+	p->in_number = false;
+}
+
+void
+int_parser_feed(struct int_parser *p, const char *buf, size_t size,
+		struct int_array *arr)
+{
+	const char *pos = buf;
+	const char *end = buf + size;
+	/*
+	 * The state is kept in locals in the hot loop, so the
+	 * compiler can keep it in registers.
+	 */
+	unsigned long long value = p->value;
+	bool in_number = p->in_number;
+	while (pos < end) {
+		unsigned digit = (unsigned char)*pos - '0';
+		if (digit < 10) {
+			value = value * 10 + digit;
+			in_number = true;
+			++pos;
+			continue;
+		}
+		if (in_number) {
+			p->value = value;
+			int_parser_push(p, arr);
+			value = 0;
+			in_number = false;
+		}
+		/* The minus counts only right before the digits. */
+		p->is_negative = *pos == '-';
+		++pos;
+	}
+	p->value = value;
+	p->in_number = in_number;
+}
+
+void
+int_parser_finish(struct int_parser *p, struct int_array *arr)
+{
+	if (p->in_number)
+		int_parser_push(p, arr);
+	int_parser_create(p);
+}
+
+int
+intfile_read(const char *path, struct int_array *arr)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	char *buf = malloc(INTFILE_CHUNK_SIZE);
+	if (buf == NULL)
+		abort();
+	struct int_parser p;
+	int_parser_create(&p);
+	int rc = 0;
+	while (true) {
+		ssize_t size = read(fd, buf, INTFILE_CHUNK_SIZE);
+		if (size < 0) {
+			if (errno == EINTR)
+				continue;
+			rc = -1;
+			break;
+		}
+		if (size == 0)
+			break;
+		int_parser_feed(&p, buf, size, arr);
+	}
+	int_parser_finish(&p, arr);
+	free(buf);
+	int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return rc;
+}
+
+int
+intfile_map_open(const char *path, struct intfile_map *m)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		goto error;
+	m->size = st.st_size;
+	m->data = NULL;
+	if (m->size == 0) {
+		close(fd);
+		return 0;
+	}
+	void *data = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		goto error;
+	/* The mapping holds the file, the descriptor is not needed. */
+	close(fd);
+	madvise(data, m->size, MADV_SEQUENTIAL);
+	m->data = data;
+	return 0;
+error:;
+	int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return -1;
+}
+
+void
+intfile_map_close(struct intfile_map *m)
+{
+	if (m->data != NULL)
+		munmap((void *)m->data, m->size);
+	m->data = NULL;
+	m->size = 0;
+}
+
+static const char intfile_digit_pairs[] =
+	"00010203040506070809101112131415161718192021222324252627282930"
+	"31323334353637383940414243444546474849505152535455565758596061"
+	"62636465666768697071727374757677787980818283848586878889909192"
+	"93949596979899";
+
+static inline size_t
+intfile_digit_count(uint32_t v)
+{
+	size_t count = 1;
+	for (;;) {
+		if (v < 10)
+			return count;
+		if (v < 100)
+			return count + 1;
+		if (v < 1000)
+			return count + 2;
+		if (v < 10000)
+			return count + 3;
+		v /= 10000;
+		count += 4;
+	}
+}
+
+size_t
+intfile_format_int(int value, char *buf)
+{
+	uint32_t v = value;
+	size_t len = 0;
+	if (value < 0) {
+		*buf++ = '-';
+		v = -v;
+		len = 1;
+	}
+	size_t count = intfile_digit_count(v);
+	char *pos = buf + count;
+	while (v >= 100) {
+		const char *pair = &intfile_digit_pairs[(v % 100) * 2];
+		v /= 100;
+		*--pos = pair[1];
+		*--pos = pair[0];
+	}
+	if (v >= 10) {
+		const char *pair = &intfile_digit_pairs[v * 2];
+		*--pos = pair[1];
+		*--pos = pair[0];
+	} else {
+		*--pos = '0' + v;
+	}
+	return len + count;
+}
+
+int
+intfile_write_all(int fd, const void *data, size_t size)
+{
+	const char *pos = data;
+	while (size > 0) {
+		ssize_t rc = write(fd, pos, size);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		pos += rc;
+		size -= rc;
+	}
+	return 0;
+}
+
+size_t
+intfile_text_size(const int *data, size_t count)
+{
+	size_t size = count;
+	for (size_t i = 0; i < count; ++i) {
+		uint32_t v = data[i];
+		if (data[i] < 0) {
+			v = -v;
+			++size;
+		}
+		size += intfile_digit_count(v);
+	}
+	return size;
+}
+
+/** Write or pwrite() all the data, retrying after short writes. */
+static int
+intfile_writer_write(struct intfile_writer *w, const void *data, size_t size)
+{
+	if (w->offset < 0)
+		return intfile_write_all(w->fd, data, size);
+	const char *pos = data;
+	while (size > 0) {
+		ssize_t rc = pwrite(w->fd, pos, size, w->offset);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		pos += rc;
+		size -= rc;
+		w->offset += rc;
+	}
+	return 0;
+}
+
+void
+intfile_writer_create(struct intfile_writer *w, int fd,
+		      enum intfile_format format)
+{
+	w->fd = fd;
+	w->format = format;
+	w->offset = -1;
+	w->buf = NULL;
+	w->size = 0;
+}
+
+void
+intfile_writer_seek(struct intfile_writer *w, off_t offset)
+{
+	w->offset = offset;
+}
+
+void
+intfile_writer_destroy(struct intfile_writer *w)
+{
+	free(w->buf);
+	w->buf = NULL;
+	w->size = 0;
+}
+
+int
+intfile_writer_flush(struct intfile_writer *w)
+{
+	if (w->size == 0)
+		return 0;
+	int rc = intfile_writer_write(w, w->buf, w->size);
+	w->size = 0;
+	return rc;
+}
+
+static inline char *
+intfile_writer_buf(struct intfile_writer *w)
+{
+	if (w->buf == NULL) {
+		w->buf = malloc(INTFILE_CHUNK_SIZE);
+		if (w->buf == NULL)
+			abort();
+	}
+	return w->buf;
+}
+
+static int
+intfile_writer_put_text(struct intfile_writer *w, const int *data,
+			size_t count)
+{
+	char *buf = intfile_writer_buf(w);
+	/* A number with its space always fits before the limit. */
+	char *limit = buf + INTFILE_CHUNK_SIZE - INTFILE_INT_MAX_LEN - 1;
+	char *pos = buf + w->size;
+	for (size_t i = 0; i < count; ++i) {
+		pos += intfile_format_int(data[i], pos);
+		*pos++ = ' ';
+		if (pos >= limit) {
+			w->size = pos - buf;
+			if (intfile_writer_flush(w) != 0)
+				return -1;
+			pos = buf;
+		}
+	}
+	w->size = pos - buf;
+	return 0;
+}
+
+static int
+intfile_writer_put_binary(struct intfile_writer *w, const int *data,
+			  size_t count)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return intfile_writer_write(w, data, count * sizeof(*data));
+#else
+	uint32_t *buf = (uint32_t *)intfile_writer_buf(w);
+	enum { BATCH = INTFILE_CHUNK_SIZE / sizeof(uint32_t) };
+	for (size_t i = 0; i < count; i += BATCH) {
+		size_t size = count - i < BATCH ? count - i : BATCH;
+		for (size_t j = 0; j < size; ++j)
+			buf[j] = __builtin_bswap32(data[i + j]);
+		if (intfile_writer_write(w, buf, size * sizeof(*buf)) != 0)
+			return -1;
+	}
+	return 0;
+#endif
+}
+
+int
+intfile_writer_put(struct intfile_writer *w, const int *data, size_t count)
+{
+	if (w->format == INTFILE_TEXT)
+		return intfile_writer_put_text(w, data, count);
+	return intfile_writer_put_binary(w, data, count);
+}
+
+int
+intfile_write(const char *path, const int *data, size_t count,
+	      enum intfile_format format)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	struct intfile_writer w;
+	intfile_writer_create(&w, fd, format);
+	int rc = intfile_writer_put(&w, data, count);
+	if (rc == 0)
+		rc = intfile_writer_flush(&w);
+	intfile_writer_destroy(&w);
+	int saved_errno = errno;
+	if (close(fd) != 0 && rc == 0)
+		return -1;
+	errno = saved_errno;
+	return rc;
+}
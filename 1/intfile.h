@@ -0,0 +1,174 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Loader of text files with whitespace separated integers. The
+ * file is read in big chunks and parsed in one pass, the numbers
+ * are appended to a geometrically growing array.
+ */
+
+/** Growing array of integers. */
+struct int_array {
+	int *data;
+	size_t size;
+	size_t capacity;
+};
+
+void
+int_array_create(struct int_array *arr);
+
+void
+int_array_destroy(struct int_array *arr);
+
+/** Make room for at least @a count more numbers. */
+void
+int_array_reserve(struct int_array *arr, size_t count);
+
+/**
+ * Streaming parser. A number can be split between two chunks, so
+ * the parser keeps the unfinished one.
+ */
+struct int_parser {
+	/** Absolute value of the unfinished number. */
+	unsigned long long value;
+	bool is_negative;
+	/** True, if a number is being parsed. */
+	bool in_number;
+};
+
+void
+int_parser_create(struct int_parser *p);
+
+/** Parse the next chunk of text, append the numbers to @a arr. */
+void
+int_parser_feed(struct int_parser *p, const char *buf, size_t size,
+		struct int_array *arr);
+
+/** End of text - append the last number, if it is unfinished. */
+void
+int_parser_finish(struct int_parser *p, struct int_array *arr);
+
+/**
+ * Read all the numbers of the file into @a arr, which should be
+ * created.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+intfile_read(const char *path, struct int_array *arr);
+
+/**
+ * Whole file mapped for reading. The kernel is told it is read
+ * sequentially, so it reads ahead aggressively and drops the
+ * pages behind.
+ */
+struct intfile_map {
+	const char *data;
+	size_t size;
+};
+
+/**
+ * Map the file. An empty file gives an empty map.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+intfile_map_open(const char *path, struct intfile_map *m);
+
+void
+intfile_map_close(struct intfile_map *m);
+
+enum {
+	/** Longest decimal int: "-2147483648". */
+	INTFILE_INT_MAX_LEN = 11,
+	/** Buffer of the file reader and of the text writer. */
+	INTFILE_CHUNK_SIZE = 1 << 20,
+};
+
+/**
+ * Print @a value in decimal into @a buf, two digits per step from
+ * a table. The buffer should have INTFILE_INT_MAX_LEN bytes, no
+ * terminating zero is written.
+ * @return Length of the number.
+ */
+size_t
+intfile_format_int(int value, char *buf);
+
+/** Size of the numbers as text, with the spaces. */
+size_t
+intfile_text_size(const int *data, size_t count);
+
+enum intfile_format {
+	/** Decimal numbers, each one followed by a space. */
+	INTFILE_TEXT,
+	/** Raw little-endian int32. */
+	INTFILE_BINARY,
+};
+
+/**
+ * Streaming writer of numbers into a file descriptor. Text is
+ * formatted into a INTFILE_CHUNK_SIZE buffer, each full one is
+ * flushed with one write(). Binary numbers on a little-endian
+ * machine are written as is, without a copy and a buffer.
+ */
+struct intfile_writer {
+	int fd;
+	enum intfile_format format;
+	/** Where to pwrite() the next data, -1 to just write(). */
+	off_t offset;
+	/** Allocated on the first need. */
+	char *buf;
+	size_t size;
+};
+
+/** The descriptor stays owned by the caller. */
+void
+intfile_writer_create(struct intfile_writer *w, int fd,
+		      enum intfile_format format);
+
+/**
+ * Write with pwrite() from @a offset on, not at the file position.
+ * So several writers can fill their own parts of one file at once.
+ */
+void
+intfile_writer_seek(struct intfile_writer *w, off_t offset);
+
+/** Free the buffer. The not flushed data is lost. */
+void
+intfile_writer_destroy(struct intfile_writer *w);
+
+/**
+ * Write @a count numbers.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+intfile_writer_put(struct intfile_writer *w, const int *data, size_t count);
+
+/**
+ * Write out the buffered data.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+intfile_writer_flush(struct intfile_writer *w);
+
+/**
+ * Write all the data, retrying after short writes.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+intfile_write_all(int fd, const void *data, size_t size);
+
+/**
+ * Write the numbers to a new file in the given format.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+intfile_write(const char *path, const int *data, size_t count,
+	      enum intfile_format format);
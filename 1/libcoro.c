@@ -1,53 +1,425 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 #include "libcoro.h"
 
+/*
+ * Context switch backend is chosen at build time. By default the
+ * coroutines are switched by a hand-written register swap, which
+ * costs a few dozens of instructions and no syscalls. Define
+ * CORO_USE_SIGJMP to use the portable sigaltstack + sigsetjmp
+ * backend instead. It is also used on the architectures without
+ * the assembly implementation.
+ */
+#if !defined(CORO_USE_SIGJMP) && !defined(__x86_64__) && \
+    !defined(__aarch64__)
+#define CORO_USE_SIGJMP
+#endif
+
+/** Stack size of a coroutine, if not specified in its attrs. */
+#define CORO_STACK_SIZE_DEFAULT (1024 * 1024)
+
+/**
+ * Stack sizes are rounded up to a power of 2 pages. Each such
+ * size class has its own list in the stack pool.
+ */
+#define CORO_STACK_CLASS_COUNT 24
+
+/** Byte to fill the stacks with, when their usage is probed. */
+#define CORO_STACK_PAINT 0xa5
+
+/**
+ * How many switches can be done without looking for I/O events,
+ * while there are ready coroutines.
+ */
+#define CORO_IO_POLL_PERIOD 64
+
+/** Count of the ready queues, one per priority. */
+#define CORO_PRIO_COUNT (CORO_PRIO_MAX - CORO_PRIO_MIN + 1)
+
 #define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
 
+enum coro_state {
+	/** Running right now, or is the scheduler. */
+	CORO_STATE_RUNNING,
+	/** In a ready queue, waiting for its turn. */
+	CORO_STATE_READY,
+	/** Suspended until coro_wakeup(). */
+	CORO_STATE_SUSPENDED,
+	/** Suspended until a timer or coro_wakeup(). */
+	CORO_STATE_SLEEPING,
+	CORO_STATE_FINISHED,
+	/*
+	 * The states below exist only in the M:N mode, where a
+	 * coroutine can be woken up by another thread while it
+	 * still runs on its stack or sits in a timer heap.
+	 */
+	/** Going to be suspended or to sleep, still on its stack. */
+	CORO_STATE_SUSPENDING,
+	/** Woken up while was CORO_STATE_SUSPENDING. */
+	CORO_STATE_WAKEUP_PENDING,
+	/** Woken up while sleeping, is in its worker's mailbox. */
+	CORO_STATE_WAKEUP_REQUESTED,
+};
+
+struct coro_worker;
+
 /** Main coroutine structure, its context. */
 struct coro {
 	/** A value, returned by func. */
 	int ret;
 	/** Stack, used by the coroutine. */
 	void *stack;
+	/** Usable size of the stack, without the guard page. */
+	size_t stack_size;
+	/** True, if the stack is painted to measure its usage. */
+	bool stack_probe;
+	/** Name for debug, can be truncated. */
+	char name[CORO_NAME_MAX];
+	/** Priority, given in the attributes. */
+	int priority;
 	/** An argument for the function func. */
 	void *func_arg;
 	/** A function to call as a coroutine. */
 	coro_f func;
+#ifdef CORO_USE_SIGJMP
 	/** Last remembered coroutine context. */
 	sigjmp_buf ctx;
+#else
+	/**
+	 * Last remembered stack pointer. Callee-saved registers
+	 * of the suspended coroutine are stored right there.
+	 */
+	void *sp;
+#endif
 	/** True, if the coroutine has finished. */
 	bool is_finished;
+	enum coro_state state;
 	long long switch_count;
 	/** Links in the coroutine list, used by scheduler. */
 	struct coro *next, *prev;
+	/** Link in a ready queue or in a worker mailbox. */
+	struct coro *ready_next;
+	/** When to wake up, if sleeping. CLOCK_MONOTONIC seconds. */
+	double wakeup_time;
+	/** Index in the timer heap, if sleeping. */
+	int timer_idx;
+	/** True, if the suspend is a sleep with a timer. */
+	bool is_sleep;
+	/** Worker, whose timer heap has the coroutine. */
+	struct coro_worker *owner;
+	/*
+	 * Profiling counters, see coro_sched_set_profiling(). All
+	 * in nanoseconds.
+	 */
+	long long cpu_time;
+	long long wait_time;
+	long long max_slice;
+	/** Thread CPU time when the current slice began. */
+	long long slice_start;
+	/** When the coroutine became ready. 0, if it is not. */
+	long long ready_since;
+	/** Time slice in coro_ticks() units, -1 if unlimited. */
+	long long quantum;
+	/** When the current slice expires, in coro_ticks(). */
+	unsigned long long slice_deadline;
 };
 
+/*
+ * The scheduler state is per thread. Usually only one thread runs
+ * coroutines. In the M:N mode each worker thread has its own
+ * scheduler, ready coroutines and timers.
+ */
+
 /**
  * Scheduler is a main coroutine - it catches and returns dead
  * ones to a user.
  */
-static struct coro coro_sched;
+static __thread struct coro coro_sched;
 /**
  * True, if in that moment the scheduler is waiting for a
  * coroutine finish.
  */
-static bool is_sched_waiting = false;
+static __thread bool is_sched_waiting = false;
 /** Which coroutine works at this moment. */
-static struct coro *coro_this_ptr = NULL;
-/** List of all the coroutines. */
+static __thread struct coro *coro_this_ptr = NULL;
+/** List of all the not finished coroutines. */
 static struct coro *coro_list = NULL;
+/** True, if the coroutine switches are timed. */
+static bool coro_is_profiling = false;
 /**
- * Buffer, used by the coroutine constructor to escape from the
- * signal handler back into the constructor to rollback
- * sigaltstack etc.
+ * Queue of the finished coroutines, not returned to the user
+ * yet. Linked via 'next'.
+ */
+static struct coro *coro_dead_head = NULL;
+static struct coro *coro_dead_tail = NULL;
+/**
+ * FIFO queues of the coroutines ready to run, one per priority.
+ * The highest priority non-empty one is served first. Suspended
+ * coroutines are not in any queue and cost nothing.
+ */
+static __thread struct coro_ready_queue {
+	struct coro *head;
+	struct coro *tail;
+} coro_ready[CORO_PRIO_COUNT];
+/** Min-heap of the sleeping coroutines by wakeup time. */
+static __thread struct coro_timer_heap {
+	struct coro **data;
+	int count;
+	int capacity;
+} coro_timers;
+
+/** Array of a work-stealing deque. Its size is a power of 2. */
+struct coro_deque_array {
+	long size;
+	/** Previous smaller array, kept until the deque is freed. */
+	struct coro_deque_array *prev;
+	struct coro *data[];
+};
+
+/**
+ * Chase-Lev work-stealing deque. Only the owner pushes to the
+ * bottom, anybody takes from the top. The owner takes from the
+ * top as well, so a yielded coroutine goes to the end of the
+ * line, and the deque stays fair.
+ */
+struct coro_deque {
+	long top;
+	long bottom;
+	struct coro_deque_array *array;
+};
+
+/** A thread of the M:N scheduler. */
+struct coro_worker {
+	pthread_t thread;
+	/** Ready coroutines of this worker. */
+	struct coro_deque deque;
+	/**
+	 * Sleeping coroutines of this worker woken up by other
+	 * threads. Only the owner can touch its timer heap, so
+	 * they are passed here. Linked via 'ready_next'.
+	 */
+	struct coro *mailbox;
+	pthread_mutex_t mailbox_lock;
+	/** State of a random generator to choose the victims. */
+	unsigned seed;
+};
+
+/** M:N scheduler, shared by all the worker threads. */
+static struct coro_mt {
+	bool is_enabled;
+	bool is_stopping;
+	struct coro_worker *workers;
+	int worker_count;
+	/**
+	 * Protects the coroutine list, the dead queue and the
+	 * inject queue.
+	 */
+	pthread_mutex_t lock;
+	/** Signaled when a coroutine is finished. */
+	pthread_cond_t dead_cond;
+	/** Idle workers wait here for new work. */
+	pthread_cond_t idle_cond;
+	int idle_count;
+	/**
+	 * Ready coroutines from the threads not being workers,
+	 * like the ones created in main(). Linked via ready_next.
+	 */
+	struct coro *inject_head;
+	struct coro *inject_tail;
+} coro_mt = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/** Worker of the current thread. NULL, if it is not a worker. */
+static __thread struct coro_worker *coro_worker_this = NULL;
+
+/**
+ * I/O event loop of the thread. Coroutines waiting for their fds
+ * are registered in its epoll, and are woken up by the scheduler.
+ */
+static __thread struct coro_io {
+	/** Epoll descriptor, created on the first wait. */
+	int epfd;
+	/** How many coroutines wait on this epoll. */
+	int waiter_count;
+	/** Switches since the last check of the events. */
+	int switch_count;
+} coro_io = {
+	.epfd = -1,
+};
+
+/** Free stacks of one size class. */
+struct coro_stack_class {
+	/** Free stacks, used as a LIFO to reuse the hottest one. */
+	void **stacks;
+	int count;
+	int capacity;
+};
+
+/**
+ * Cache of free coroutine stacks, one per thread. The stacks are
+ * mmaped with a PROT_NONE guard page below, so an overflow
+ * crashes right away instead of silently corrupting the heap.
+ * Deleted coroutines return their stacks here, and the new ones
+ * take them back already faulted in.
+ */
+static __thread struct coro_stack_pool {
+	struct coro_stack_class classes[CORO_STACK_CLASS_COUNT];
+	/** Free stacks in all the classes. */
+	int count;
+	/** How many free stacks to keep. The rest are unmapped. */
+	int max_cached;
+	/** Drop the pages of the stacks returned to the pool. */
+	bool release_pages;
+	/** Protect the guard pages of the new stacks. */
+	bool use_guard;
+	long long hits;
+	long long misses;
+} stack_pool = {
+	.max_cached = 1024,
+	.use_guard = true,
+};
+
+static size_t
+coro_page_size(void)
+{
+	static size_t page_size = 0;
+	if (page_size == 0)
+		page_size = sysconf(_SC_PAGESIZE);
+	return page_size;
+}
+
+/**
+ * Round a requested stack size up to its size class. Returns the
+ * class index, or -1 if the stack is too big to be pooled. In
+ * the latter case it is still rounded up to a page.
  */
-static sigjmp_buf start_point;
+static int
+coro_stack_class(size_t *size)
+{
+	size_t page = coro_page_size();
+	size_t class_size = page;
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i) {
+		if (class_size >= *size) {
+			*size = class_size;
+			return i;
+		}
+		class_size *= 2;
+	}
+	*size = (*size + page - 1) / page * page;
+	return -1;
+}
+
+/**
+ * Take a stack of @a size bytes from the pool or map a new one.
+ * The size should be already rounded by coro_stack_class().
+ */
+static void *
+coro_stack_new(size_t size, int class_id)
+{
+	if (class_id >= 0) {
+		struct coro_stack_class *cls = &stack_pool.classes[class_id];
+		if (cls->count > 0) {
+			++stack_pool.hits;
+			--stack_pool.count;
+			return cls->stacks[--cls->count];
+		}
+	}
+	++stack_pool.misses;
+	size_t page = coro_page_size();
+	char *map = mmap(NULL, size + page, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (map == MAP_FAILED)
+		handle_error();
+	/*
+	 * Stack grows down, so the guard is the lowest page. Each
+	 * protected guard splits the mapping into a separate VMA,
+	 * and their count is limited by vm.max_map_count. Without
+	 * the guard the page is just left unused, and the stacks
+	 * mapped one after another are merged into one VMA.
+	 */
+	if (stack_pool.use_guard && mprotect(map, page, PROT_NONE) != 0)
+		handle_error();
+	return map + page;
+}
+
+static void
+coro_stack_unmap(void *stack, size_t size)
+{
+	size_t page = coro_page_size();
+	if (munmap((char *)stack - page, size + page) != 0)
+		handle_error();
+}
+
+/** Return a stack to the pool, or unmap it if the pool is full. */
+static void
+coro_stack_delete(void *stack, size_t size)
+{
+	int class_id = coro_stack_class(&size);
+	if (class_id < 0 || stack_pool.count >= stack_pool.max_cached) {
+		coro_stack_unmap(stack, size);
+		return;
+	}
+	struct coro_stack_class *cls = &stack_pool.classes[class_id];
+	if (cls->count == cls->capacity) {
+		cls->capacity = (cls->capacity + 1) * 2;
+		cls->stacks = realloc(cls->stacks,
+				      sizeof(*cls->stacks) * cls->capacity);
+	}
+	if (stack_pool.release_pages)
+		madvise(stack, size, MADV_DONTNEED);
+	cls->stacks[cls->count++] = stack;
+	++stack_pool.count;
+}
+
+void
+coro_stack_pool_configure(int max_cached, bool release_pages, bool use_guard)
+{
+	if (max_cached < 0)
+		max_cached = 0;
+	stack_pool.max_cached = max_cached;
+	stack_pool.release_pages = release_pages;
+	stack_pool.use_guard = use_guard;
+	/* Trim the biggest stacks first. */
+	size_t size = coro_page_size() << (CORO_STACK_CLASS_COUNT - 1);
+	for (int i = CORO_STACK_CLASS_COUNT - 1; i >= 0; --i, size /= 2) {
+		struct coro_stack_class *cls = &stack_pool.classes[i];
+		while (cls->count > 0 && stack_pool.count > max_cached) {
+			coro_stack_unmap(cls->stacks[--cls->count], size);
+			--stack_pool.count;
+		}
+		if (cls->count == 0) {
+			free(cls->stacks);
+			cls->stacks = NULL;
+			cls->capacity = 0;
+		}
+	}
+}
+
+void
+coro_stack_pool_stats(struct coro_stack_pool_stats *stats)
+{
+	stats->hits = stack_pool.hits;
+	stats->misses = stack_pool.misses;
+	stats->cached = stack_pool.count;
+}
 
 /** Add a new coroutine to the beginning of the list. */
 static void
@@ -73,129 +445,1054 @@ coro_list_delete(struct coro *c)
 		coro_list = next;
 }
 
-int
-coro_status(const struct coro *c)
+/** Add a finished coroutine to the end of the dead queue. */
+static void
+coro_dead_push(struct coro *c)
 {
-	return c->ret;
+	c->next = NULL;
+	c->prev = NULL;
+	if (coro_dead_tail == NULL)
+		coro_dead_head = c;
+	else
+		coro_dead_tail->next = c;
+	coro_dead_tail = c;
 }
 
-long long
-coro_switch_count(const struct coro *c)
+/** Pop the oldest finished coroutine. NULL, if none. */
+static struct coro *
+coro_dead_pop(void)
 {
-	return c->switch_count;
+	struct coro *c = coro_dead_head;
+	if (c == NULL)
+		return NULL;
+	coro_dead_head = c->next;
+	if (coro_dead_head == NULL)
+		coro_dead_tail = NULL;
+	c->next = NULL;
+	return c;
 }
 
-bool
-coro_is_finished(const struct coro *c)
+static long long
+coro_clock_ns(clockid_t clock)
 {
-	return c->is_finished;
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
-void
-coro_delete(struct coro *c)
+/** Remember when the coroutine became ready, to know its wait. */
+static inline void
+coro_prof_ready(struct coro *c)
 {
-	free(c->stack);
-	free(c);
+	if (coro_is_profiling)
+		c->ready_since = coro_clock_ns(CLOCK_MONOTONIC);
 }
 
-/** Switch the current coroutine to an arbitrary one. */
+/**
+ * Close the slice of the coroutine leaving the thread and open
+ * one of the coming coroutine. The thread CPU clock is a syscall,
+ * so it is only read when profiling is on.
+ */
 static void
-coro_yield_to(struct coro *to)
+coro_prof_switch(struct coro *from, struct coro *to)
 {
-	struct coro *from = coro_this_ptr;
-	++from->switch_count;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
-	coro_this_ptr = from;
+	long long now = coro_clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	if (from->slice_start != 0) {
+		long long slice = now - from->slice_start;
+		from->cpu_time += slice;
+		if (slice > from->max_slice)
+			from->max_slice = slice;
+	}
+	to->slice_start = now;
+	if (to->ready_since != 0) {
+		to->wait_time += coro_clock_ns(CLOCK_MONOTONIC) -
+				 to->ready_since;
+		to->ready_since = 0;
+	}
 }
 
-void
-coro_yield(void)
+/**
+ * A cheap monotonic counter for the time slices: the time stamp
+ * counter on x86-64, the virtual counter on aarch64. Both tick
+ * at a constant rate on the current CPUs. Elsewhere it is the
+ * coarse clock in nanoseconds - still no syscall, but the
+ * resolution is a jiffy.
+ */
+static inline unsigned long long
+coro_ticks(void)
 {
-	struct coro *from = coro_this_ptr;
-	struct coro *to = from->next;
-	if (to == NULL)
-		coro_yield_to(&coro_sched);
+#if defined(__x86_64__)
+	unsigned lo, hi;
+	__asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((unsigned long long)hi << 32) | lo;
+#elif defined(__aarch64__)
+	unsigned long long v;
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(v));
+	return v;
+#else
+	return coro_clock_ns(CLOCK_MONOTONIC_COARSE);
+#endif
+}
+
+/** coro_ticks() per microsecond, found once. */
+static double coro_ticks_per_us = 0;
+static pthread_once_t coro_ticks_once = PTHREAD_ONCE_INIT;
+
+#if defined(__x86_64__)
+/**
+ * Read the counter and the clock at the same moment. If the
+ * thread was preempted in between, the pair is wrong - retry.
+ */
+static void
+coro_ticks_sample(unsigned long long *ticks, long long *ns)
+{
+	unsigned long long before, after;
+	do {
+		before = coro_ticks();
+		*ns = coro_clock_ns(CLOCK_MONOTONIC);
+		after = coro_ticks();
+	} while (after - before > 100000);
+	*ticks = before + (after - before) / 2;
+}
+#endif
+
+static void
+coro_ticks_calibrate(void)
+{
+#if defined(__x86_64__)
+	/* The TSC rate is not reported, so it is measured. */
+	unsigned long long start, end;
+	long long start_ns, end_ns;
+	coro_ticks_sample(&start, &start_ns);
+	do {
+		coro_ticks_sample(&end, &end_ns);
+	} while (end_ns - start_ns < 2000000);
+	coro_ticks_per_us = (end - start) * 1000.0 / (end_ns - start_ns);
+#elif defined(__aarch64__)
+	unsigned long long freq;
+	__asm__ volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+	coro_ticks_per_us = freq / 1e6;
+#else
+	coro_ticks_per_us = 1000;
+#endif
+}
+
+/** Put a coroutine to the end of its priority ready queue. */
+static void
+coro_ready_push(struct coro *c)
+{
+	struct coro_ready_queue *q = &coro_ready[c->priority - CORO_PRIO_MIN];
+	c->state = CORO_STATE_READY;
+	c->ready_next = NULL;
+	coro_prof_ready(c);
+	if (q->tail == NULL)
+		q->head = c;
 	else
-		coro_yield_to(to);
+		q->tail->ready_next = c;
+	q->tail = c;
 }
 
-void
-coro_sched_init(void)
+/** Pop the next coroutine to run. NULL, if none is ready. */
+static struct coro *
+coro_ready_pop(void)
 {
-	memset(&coro_sched, 0, sizeof(coro_sched));
-	coro_this_ptr = &coro_sched;
+	for (int i = CORO_PRIO_COUNT - 1; i >= 0; --i) {
+		struct coro_ready_queue *q = &coro_ready[i];
+		struct coro *c = q->head;
+		if (c == NULL)
+			continue;
+		q->head = c->ready_next;
+		if (q->head == NULL)
+			q->tail = NULL;
+		c->ready_next = NULL;
+		return c;
+	}
+	return NULL;
 }
 
-struct coro *
-coro_sched_wait(void)
+static double
+coro_clock(void)
 {
-	while (coro_list != NULL) {
-		for (struct coro *c = coro_list; c != NULL; c = c->next) {
-			if (c->is_finished) {
-				coro_list_delete(c);
-				return c;
-			}
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline bool
+coro_timer_less(const struct coro *a, const struct coro *b)
+{
+	return a->wakeup_time < b->wakeup_time;
+}
+
+static void
+coro_timer_set(int idx, struct coro *c)
+{
+	coro_timers.data[idx] = c;
+	c->timer_idx = idx;
+}
+
+static void
+coro_timer_sift_up(int idx)
+{
+	struct coro *c = coro_timers.data[idx];
+	while (idx > 0) {
+		int parent = (idx - 1) / 2;
+		if (!coro_timer_less(c, coro_timers.data[parent]))
+			break;
+		coro_timer_set(idx, coro_timers.data[parent]);
+		idx = parent;
+	}
+	coro_timer_set(idx, c);
+}
+
+static void
+coro_timer_sift_down(int idx)
+{
+	struct coro *c = coro_timers.data[idx];
+	while (true) {
+		int child = idx * 2 + 1;
+		if (child >= coro_timers.count)
+			break;
+		if (child + 1 < coro_timers.count &&
+		    coro_timer_less(coro_timers.data[child + 1],
+				    coro_timers.data[child]))
+			++child;
+		if (!coro_timer_less(coro_timers.data[child], c))
+			break;
+		coro_timer_set(idx, coro_timers.data[child]);
+		idx = child;
+	}
+	coro_timer_set(idx, c);
+}
+
+static void
+coro_timer_add(struct coro *c)
+{
+	if (coro_timers.count == coro_timers.capacity) {
+		coro_timers.capacity = (coro_timers.capacity + 1) * 2;
+		coro_timers.data = realloc(coro_timers.data,
+			sizeof(*coro_timers.data) * coro_timers.capacity);
+	}
+	coro_timer_set(coro_timers.count++, c);
+	coro_timer_sift_up(c->timer_idx);
+}
+
+static void
+coro_timer_delete(struct coro *c)
+{
+	int idx = c->timer_idx;
+	struct coro *last = coro_timers.data[--coro_timers.count];
+	c->timer_idx = -1;
+	if (last == c)
+		return;
+	coro_timer_set(idx, last);
+	coro_timer_sift_down(idx);
+	coro_timer_sift_up(last->timer_idx);
+}
+
+static void
+coro_mt_make_ready(struct coro *c);
+
+static void
+coro_io_poll(int timeout_ms);
+
+static inline bool
+coro_io_has_waiters(void)
+{
+	return __atomic_load_n(&coro_io.waiter_count, __ATOMIC_RELAXED) > 0;
+}
+
+/**
+ * Milliseconds to wait for I/O until @a deadline, for epoll_wait.
+ * Rounded up to not wake up before the timer fires.
+ */
+static int
+coro_io_timeout(double deadline)
+{
+	double timeout = (deadline - coro_clock()) * 1000;
+	if (timeout <= 0)
+		return 0;
+	return (int)timeout + 1;
+}
+
+/** Make ready all the sleeping coroutines whose time has come. */
+static void
+coro_timers_process(void)
+{
+	if (coro_timers.count == 0)
+		return;
+	double now = coro_clock();
+	while (coro_timers.count > 0 && coro_timers.data[0]->wakeup_time <= now) {
+		struct coro *c = coro_timers.data[0];
+		coro_timer_delete(c);
+		if (coro_worker_this == NULL) {
+			coro_ready_push(c);
+			continue;
 		}
-		is_sched_waiting = true;
-		coro_yield_to(coro_list);
-		is_sched_waiting = false;
+		/*
+		 * If another thread has woken it up already, it is
+		 * in the mailbox and will be made ready from there.
+		 */
+		enum coro_state old = CORO_STATE_SLEEPING;
+		if (__atomic_compare_exchange_n(&c->state, &old,
+						CORO_STATE_READY, false,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE))
+			coro_mt_make_ready(c);
 	}
-	return NULL;
 }
 
-struct coro *
-coro_this(void)
+static struct coro_deque_array *
+coro_deque_array_new(long size)
 {
-	return coro_this_ptr;
+	struct coro_deque_array *a =
+		malloc(sizeof(*a) + sizeof(a->data[0]) * size);
+	a->size = size;
+	a->prev = NULL;
+	return a;
+}
+
+static void
+coro_deque_create(struct coro_deque *d)
+{
+	d->top = 0;
+	d->bottom = 0;
+	d->array = coro_deque_array_new(64);
+}
+
+static void
+coro_deque_destroy(struct coro_deque *d)
+{
+	struct coro_deque_array *a = d->array;
+	while (a != NULL) {
+		struct coro_deque_array *prev = a->prev;
+		free(a);
+		a = prev;
+	}
+}
+
+/** Push to the bottom. Only the owner thread can do that. */
+static void
+coro_deque_push(struct coro_deque *d, struct coro *c)
+{
+	coro_prof_ready(c);
+	long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+	long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	struct coro_deque_array *a =
+		__atomic_load_n(&d->array, __ATOMIC_RELAXED);
+	if (b - t > a->size - 1) {
+		/*
+		 * The thieves can still read the old array, so it
+		 * is not freed until the deque is destroyed.
+		 */
+		struct coro_deque_array *new_a =
+			coro_deque_array_new(a->size * 2);
+		for (long i = t; i < b; ++i)
+			new_a->data[i & (new_a->size - 1)] =
+				a->data[i & (a->size - 1)];
+		new_a->prev = a;
+		__atomic_store_n(&d->array, new_a, __ATOMIC_RELEASE);
+		a = new_a;
+	}
+	__atomic_store_n(&a->data[b & (a->size - 1)], c, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
 }
 
 /**
- * The core part of the coroutines creation - this signal handler
- * is run on a separate stack using sigaltstack. On an invokation
- * it remembers its current context and jumps back to the
- * coroutine constructor. Later the coroutine continues from here.
+ * Take from the top. Can be called by any thread. NULL, if the
+ * deque is empty or the race for the top element is lost.
  */
+static struct coro *
+coro_deque_steal(struct coro_deque *d)
+{
+	long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b)
+		return NULL;
+	struct coro_deque_array *a =
+		__atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+	struct coro *c = __atomic_load_n(&a->data[t & (a->size - 1)],
+					 __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+					 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+	return c;
+}
+
+/** Wake up one idle worker, if there are any. */
 static void
-coro_body(int signum)
+coro_mt_notify(void)
 {
-	(void)signum;
-	struct coro *c = coro_this_ptr;
-	coro_this_ptr = NULL;
-	/*
-	 * On an invokation jump back to the constructor right
-	 * after remembering the context.
-	 */
-	if (sigsetjmp(c->ctx, 0) == 0)
-		siglongjmp(start_point, 1);
-	/*
-	 * If the execution is here, then the coroutine should
-	 * finaly start work.
-	 */
-	coro_this_ptr = c;
-	c->ret = c->func(c->func_arg);
-	c->is_finished = true;
-	/* Can not return - 'ret' address is invalid already! */
-	if (! is_sched_waiting) {
-		printf("Critical error - no place to return!\n");
-		exit(-1);
+	if (__atomic_load_n(&coro_mt.idle_count, __ATOMIC_ACQUIRE) == 0)
+		return;
+	pthread_mutex_lock(&coro_mt.lock);
+	pthread_cond_signal(&coro_mt.idle_cond);
+	pthread_mutex_unlock(&coro_mt.lock);
+}
+
+/**
+ * Give a ready coroutine to the M:N scheduler. A worker puts it
+ * into its own deque, other threads into the inject queue.
+ */
+static void
+coro_mt_make_ready(struct coro *c)
+{
+	if (coro_worker_this != NULL) {
+		coro_deque_push(&coro_worker_this->deque, c);
+	} else {
+		c->ready_next = NULL;
+		coro_prof_ready(c);
+		pthread_mutex_lock(&coro_mt.lock);
+		if (coro_mt.inject_tail == NULL)
+			coro_mt.inject_head = c;
+		else
+			coro_mt.inject_tail->ready_next = c;
+		coro_mt.inject_tail = c;
+		pthread_mutex_unlock(&coro_mt.lock);
 	}
-	siglongjmp(coro_sched.ctx, 1);
+	coro_mt_notify();
 }
 
-struct coro *
-coro_new(coro_f func, void *func_arg)
+int
+coro_status(const struct coro *c)
+{
+	return c->ret;
+}
+
+long long
+coro_switch_count(const struct coro *c)
+{
+	return c->switch_count;
+}
+
+void
+coro_stats(const struct coro *c, struct coro_stats *stats)
+{
+	stats->cpu_time = c->cpu_time;
+	stats->wait_time = c->wait_time;
+	stats->max_slice = c->max_slice;
+	stats->switch_count = c->switch_count;
+}
+
+void
+coro_sched_set_profiling(bool is_enabled)
+{
+	coro_is_profiling = is_enabled;
+}
+
+static const char *const coro_state_strs[] = {
+	[CORO_STATE_RUNNING] = "running",
+	[CORO_STATE_READY] = "ready",
+	[CORO_STATE_SUSPENDED] = "suspended",
+	[CORO_STATE_SLEEPING] = "sleeping",
+	[CORO_STATE_FINISHED] = "finished",
+	[CORO_STATE_SUSPENDING] = "suspending",
+	[CORO_STATE_WAKEUP_PENDING] = "wakeup pending",
+	[CORO_STATE_WAKEUP_REQUESTED] = "wakeup requested",
+};
+
+void
+coro_sched_dump(FILE *out)
+{
+	if (coro_mt.is_enabled)
+		pthread_mutex_lock(&coro_mt.lock);
+	fprintf(out, "%-16s %-16s %10s %10s %10s %10s\n", "coro", "state",
+		"switches", "cpu us", "wait us", "slice us");
+	for (const struct coro *c = coro_list; c != NULL; c = c->next) {
+		char name[CORO_NAME_MAX];
+		if (c->name[0] != 0)
+			snprintf(name, sizeof(name), "%s", c->name);
+		else
+			snprintf(name, sizeof(name), "%p", (const void *)c);
+		enum coro_state state =
+			__atomic_load_n(&c->state, __ATOMIC_RELAXED);
+		fprintf(out, "%-16s %-16s %10lld %10lld %10lld %10lld\n",
+			name, coro_state_strs[state], c->switch_count,
+			c->cpu_time / 1000, c->wait_time / 1000,
+			c->max_slice / 1000);
+	}
+	if (coro_mt.is_enabled)
+		pthread_mutex_unlock(&coro_mt.lock);
+}
+
+const char *
+coro_name(const struct coro *c)
+{
+	return c->name;
+}
+
+int
+coro_priority(const struct coro *c)
+{
+	return c->priority;
+}
+
+long long
+coro_stack_usage(const struct coro *c)
+{
+	if (!c->stack_probe)
+		return -1;
+	const unsigned char *pos = c->stack;
+	const unsigned char *end = pos + c->stack_size;
+	while (pos < end && *pos == CORO_STACK_PAINT)
+		++pos;
+	return end - pos;
+}
+
+bool
+coro_is_finished(const struct coro *c)
+{
+	return c->is_finished;
+}
+
+void
+coro_delete(struct coro *c)
+{
+	coro_stack_delete(c->stack, c->stack_size);
+	free(c);
+}
+
+static void
+coro_context_switch(struct coro *from, struct coro *to);
+
+/**
+ * Set the current coroutine after a switch back. In the M:N mode
+ * the coroutine can be resumed by another thread, so the address
+ * of the thread-local variable has to be taken anew, not reused
+ * by the compiler from before the switch.
+ */
+static void __attribute__((noinline))
+coro_this_set(struct coro *c)
+{
+	coro_this_ptr = c;
+}
+
+/** Switch the current coroutine to an arbitrary one. */
+static void
+coro_yield_to(struct coro *to)
+{
+	struct coro *from = coro_this_ptr;
+	++from->switch_count;
+	if (coro_is_profiling)
+		coro_prof_switch(from, to);
+	if (to->quantum >= 0)
+		to->slice_deadline = coro_ticks() + to->quantum;
+	coro_this_ptr = to;
+	coro_context_switch(from, to);
+	coro_this_set(from);
+}
+
+/**
+ * Leave the current coroutine, which is already not running, for
+ * the next ready one. If none is ready, go to the scheduler - it
+ * waits for the timers.
+ */
+static void
+coro_switch_away(void)
+{
+	if (coro_io_has_waiters() &&
+	    ++coro_io.switch_count >= CORO_IO_POLL_PERIOD)
+		coro_io_poll(0);
+	coro_timers_process();
+	struct coro *to = coro_ready_pop();
+	if (to == coro_this_ptr) {
+		/* Nobody else is ready, a new slice starts. */
+		to->state = CORO_STATE_RUNNING;
+		to->ready_since = 0;
+		if (to->quantum >= 0)
+			to->slice_deadline = coro_ticks() + to->quantum;
+		return;
+	}
+	if (to == NULL)
+		to = &coro_sched;
+	else
+		to->state = CORO_STATE_RUNNING;
+	coro_yield_to(to);
+}
+
+/**
+ * In the M:N mode a coroutine always goes back to its worker
+ * scheduler. Only there, when the coroutine's stack is not used
+ * anymore, it can be made visible to the other threads.
+ */
+static void
+coro_mt_switch_to_sched(enum coro_state state)
+{
+	__atomic_store_n(&coro_this_ptr->state, state, __ATOMIC_RELEASE);
+	coro_yield_to(&coro_sched);
+}
+
+void
+coro_yield(void)
+{
+	if (coro_worker_this != NULL) {
+		coro_mt_switch_to_sched(CORO_STATE_READY);
+		return;
+	}
+	coro_ready_push(coro_this_ptr);
+	coro_switch_away();
+}
+
+void
+coro_suspend(void)
+{
+	if (coro_worker_this != NULL) {
+		coro_this_ptr->is_sleep = false;
+		coro_mt_switch_to_sched(CORO_STATE_SUSPENDING);
+		return;
+	}
+	coro_this_ptr->state = CORO_STATE_SUSPENDED;
+	coro_switch_away();
+}
+
+static inline void
+coro_spin_lock(int *lock)
+{
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE) != 0) {
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED) != 0)
+			sched_yield();
+	}
+}
+
+static inline void
+coro_spin_unlock(int *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Suspend the current coroutine and release @a lock. In the M:N
+ * mode the coroutine becomes "suspending" before the unlock, so
+ * a wakeup done right after the unlock by another thread is not
+ * lost. Not inlined for the same reason as coro_this_set() - the
+ * caller can continue in another thread.
+ */
+static void __attribute__((noinline))
+coro_suspend_unlock(int *lock)
+{
+	if (coro_worker_this != NULL) {
+		coro_this_ptr->is_sleep = false;
+		__atomic_store_n(&coro_this_ptr->state, CORO_STATE_SUSPENDING,
+				 __ATOMIC_RELEASE);
+		coro_spin_unlock(lock);
+		coro_yield_to(&coro_sched);
+		return;
+	}
+	coro_this_ptr->state = CORO_STATE_SUSPENDED;
+	coro_spin_unlock(lock);
+	coro_switch_away();
+}
+
+/** Pass a woken up sleeping coroutine to its worker. */
+static void
+coro_mt_mailbox_push(struct coro *c)
+{
+	struct coro_worker *w = c->owner;
+	pthread_mutex_lock(&w->mailbox_lock);
+	c->ready_next = w->mailbox;
+	w->mailbox = c;
+	pthread_mutex_unlock(&w->mailbox_lock);
+	/* The owner might be idle, so wake up all of them. */
+	if (__atomic_load_n(&coro_mt.idle_count, __ATOMIC_ACQUIRE) > 0) {
+		pthread_mutex_lock(&coro_mt.lock);
+		pthread_cond_broadcast(&coro_mt.idle_cond);
+		pthread_mutex_unlock(&coro_mt.lock);
+	}
+}
+
+static void
+coro_mt_wakeup(struct coro *c)
+{
+	enum coro_state state = __atomic_load_n(&c->state, __ATOMIC_ACQUIRE);
+	while (true) {
+		enum coro_state new_state;
+		switch (state) {
+		case CORO_STATE_SUSPENDED:
+			new_state = CORO_STATE_READY;
+			break;
+		case CORO_STATE_SUSPENDING:
+			new_state = CORO_STATE_WAKEUP_PENDING;
+			break;
+		case CORO_STATE_SLEEPING:
+			new_state = CORO_STATE_WAKEUP_REQUESTED;
+			break;
+		default:
+			return;
+		}
+		if (!__atomic_compare_exchange_n(&c->state, &state, new_state,
+						 false, __ATOMIC_ACQ_REL,
+						 __ATOMIC_ACQUIRE))
+			continue;
+		if (new_state == CORO_STATE_READY)
+			coro_mt_make_ready(c);
+		else if (new_state == CORO_STATE_WAKEUP_REQUESTED)
+			coro_mt_mailbox_push(c);
+		return;
+	}
+}
+
+void
+coro_wakeup(struct coro *c)
+{
+	if (coro_mt.is_enabled) {
+		coro_mt_wakeup(c);
+		return;
+	}
+	if (c->state == CORO_STATE_SLEEPING)
+		coro_timer_delete(c);
+	else if (c->state != CORO_STATE_SUSPENDED)
+		return;
+	coro_ready_push(c);
+}
+
+void
+coro_sleep(double seconds)
+{
+	struct coro *c = coro_this_ptr;
+	c->wakeup_time = coro_clock() + seconds;
+	if (coro_worker_this != NULL) {
+		c->is_sleep = true;
+		coro_mt_switch_to_sched(CORO_STATE_SUSPENDING);
+		return;
+	}
+	c->state = CORO_STATE_SLEEPING;
+	coro_timer_add(c);
+	coro_switch_away();
+}
+
+/** Wake up the coroutines whose fds are ready. */
+static void
+coro_io_poll(int timeout_ms)
+{
+	coro_io.switch_count = 0;
+	struct epoll_event events[64];
+	int count = epoll_wait(coro_io.epfd, events, 64, timeout_ms);
+	for (int i = 0; i < count; ++i)
+		coro_wakeup(events[i].data.ptr);
+}
+
+int
+coro_wait_fd(int fd, int events)
+{
+	if (coro_this_ptr == NULL || coro_this_ptr == &coro_sched) {
+		/* Not a coroutine - nobody to switch to. */
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = ((events & CORO_EVENT_READ) ? POLLIN : 0) |
+			     ((events & CORO_EVENT_WRITE) ? POLLOUT : 0);
+		return poll(&pfd, 1, -1) < 0 ? -1 : 0;
+	}
+	if (coro_io.epfd < 0) {
+		coro_io.epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (coro_io.epfd < 0)
+			return -1;
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLONESHOT |
+		    ((events & CORO_EVENT_READ) ? EPOLLIN : 0) |
+		    ((events & CORO_EVENT_WRITE) ? EPOLLOUT : 0);
+	ev.data.ptr = coro_this_ptr;
+	/*
+	 * In the M:N mode the coroutine can be resumed by another
+	 * worker, so the event loop is remembered here.
+	 */
+	struct coro_io *io = &coro_io;
+	int wait_fd = fd;
+	int rc = epoll_ctl(io->epfd, EPOLL_CTL_ADD, fd, &ev);
+	if (rc != 0 && errno == EEXIST) {
+		/*
+		 * Another coroutine waits on this fd already. epoll keys
+		 * the registrations by the descriptor number, so a
+		 * duplicate of the fd gets its own one.
+		 */
+		wait_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+		if (wait_fd < 0)
+			return -1;
+		rc = epoll_ctl(io->epfd, EPOLL_CTL_ADD, wait_fd, &ev);
+	}
+	if (rc != 0) {
+		int saved_errno = errno;
+		if (wait_fd != fd)
+			close(wait_fd);
+		/* Regular files are always ready and can't be polled. */
+		if (saved_errno == EPERM)
+			return 0;
+		errno = saved_errno;
+		return -1;
+	}
+	__atomic_add_fetch(&io->waiter_count, 1, __ATOMIC_RELAXED);
+	coro_suspend();
+	epoll_ctl(io->epfd, EPOLL_CTL_DEL, wait_fd, NULL);
+	if (wait_fd != fd)
+		close(wait_fd);
+	__atomic_sub_fetch(&io->waiter_count, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/** True, if the error means the fd is not ready. */
+static inline bool
+coro_io_would_block(int err)
+{
+	return err == EAGAIN || err == EWOULDBLOCK;
+}
+
+ssize_t
+coro_read(int fd, void *buf, size_t count)
+{
+	while (true) {
+		ssize_t rc = read(fd, buf, count);
+		if (rc >= 0)
+			return rc;
+		if (errno == EINTR)
+			continue;
+		if (!coro_io_would_block(errno) ||
+		    coro_wait_fd(fd, CORO_EVENT_READ) != 0)
+			return -1;
+	}
+}
+
+ssize_t
+coro_write(int fd, const void *buf, size_t count)
+{
+	while (true) {
+		ssize_t rc = write(fd, buf, count);
+		if (rc >= 0)
+			return rc;
+		if (errno == EINTR)
+			continue;
+		if (!coro_io_would_block(errno) ||
+		    coro_wait_fd(fd, CORO_EVENT_WRITE) != 0)
+			return -1;
+	}
+}
+
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	while (true) {
+		int rc = accept4(fd, addr, addrlen, SOCK_NONBLOCK);
+		if (rc >= 0)
+			return rc;
+		if (errno == EINTR)
+			continue;
+		if (!coro_io_would_block(errno) ||
+		    coro_wait_fd(fd, CORO_EVENT_READ) != 0)
+			return -1;
+	}
+}
+
+int
+coro_connect(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+	if (connect(fd, addr, addrlen) == 0)
+		return 0;
+	if (errno != EINPROGRESS && errno != EINTR)
+		return -1;
+	if (coro_wait_fd(fd, CORO_EVENT_WRITE) != 0)
+		return -1;
+	int err;
+	socklen_t len = sizeof(err);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+		return -1;
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+void
+coro_sched_init(void)
+{
+	memset(&coro_sched, 0, sizeof(coro_sched));
+	coro_sched.state = CORO_STATE_RUNNING;
+	coro_sched.quantum = -1;
+	coro_this_ptr = &coro_sched;
+}
+
+/**
+ * Find the next coroutine to run from the scheduler. When none is
+ * ready, sleep until the nearest timer.
+ */
+static struct coro *
+coro_sched_next(void)
+{
+	while (true) {
+		coro_timers_process();
+		struct coro *c = coro_ready_pop();
+		if (c != NULL)
+			return c;
+		if (coro_io_has_waiters()) {
+			int timeout = -1;
+			if (coro_timers.count > 0) {
+				timeout = coro_io_timeout(
+					coro_timers.data[0]->wakeup_time);
+			}
+			coro_io_poll(timeout);
+			continue;
+		}
+		if (coro_timers.count == 0)
+			return NULL;
+		double timeout = coro_timers.data[0]->wakeup_time;
+		struct timespec ts;
+		ts.tv_sec = (time_t)timeout;
+		ts.tv_nsec = (long)((timeout - ts.tv_sec) * 1e9);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+}
+
+struct coro *
+coro_sched_wait(void)
+{
+	if (coro_mt.is_enabled) {
+		pthread_mutex_lock(&coro_mt.lock);
+		while (coro_dead_head == NULL && coro_list != NULL)
+			pthread_cond_wait(&coro_mt.dead_cond, &coro_mt.lock);
+		struct coro *c = coro_dead_pop();
+		pthread_mutex_unlock(&coro_mt.lock);
+		return c;
+	}
+	while (true) {
+		struct coro *c = coro_dead_pop();
+		if (c != NULL)
+			return c;
+		if (coro_list == NULL)
+			break;
+		c = coro_sched_next();
+		if (c == NULL) {
+			printf("Critical error - all coroutines are suspended!\n");
+			exit(-1);
+		}
+		c->state = CORO_STATE_RUNNING;
+		is_sched_waiting = true;
+		coro_yield_to(c);
+		is_sched_waiting = false;
+	}
+	return NULL;
+}
+
+struct coro *
+coro_this(void)
+{
+	return coro_this_ptr;
+}
+
+void
+coro_set_quantum(long long us)
+{
+	struct coro *c = coro_this_ptr;
+	if (us < 0) {
+		c->quantum = -1;
+		return;
+	}
+	pthread_once(&coro_ticks_once, coro_ticks_calibrate);
+	c->quantum = us * coro_ticks_per_us;
+	c->slice_deadline = coro_ticks() + c->quantum;
+}
+
+bool
+coro_is_expired(void)
+{
+	struct coro *c = coro_this_ptr;
+	return c->quantum >= 0 && coro_ticks() >= c->slice_deadline;
+}
+
+bool
+coro_yield_if_expired(void)
+{
+	if (!coro_is_expired())
+		return false;
+	coro_yield();
+	return true;
+}
+
+/**
+ * Coroutine body, common for all the backends. It is started on
+ * the coroutine's own stack with the first switch into it, and
+ * never returns.
+ */
+static void
+coro_body_run(struct coro *c)
+{
+	c->ret = c->func(c->func_arg);
+	c->is_finished = true;
+	if (coro_worker_this != NULL) {
+		/* The worker moves it to the dead queue. */
+		coro_mt_switch_to_sched(CORO_STATE_FINISHED);
+		abort();
+	}
+	c->state = CORO_STATE_FINISHED;
+	/*
+	 * Move to the dead queue right away, so as the scheduler
+	 * would find it without a scan, and the others wouldn't
+	 * yield to it.
+	 */
+	coro_list_delete(c);
+	coro_dead_push(c);
+	/* Can not return - 'ret' address is invalid already! */
+	if (! is_sched_waiting) {
+		printf("Critical error - no place to return!\n");
+		exit(-1);
+	}
+	/* The last slice counts too. */
+	if (coro_is_profiling)
+		coro_prof_switch(c, &coro_sched);
+	coro_context_switch(c, &coro_sched);
+	/* Finished coroutines are never switched to. */
+	abort();
+}
+
+#ifdef CORO_USE_SIGJMP
+
+/**
+ * Buffer, used by the coroutine constructor to escape from the
+ * signal handler back into the constructor to rollback
+ * sigaltstack etc.
+ */
+static __thread sigjmp_buf start_point;
+
+static void
+coro_context_switch(struct coro *from, struct coro *to)
+{
+	if (sigsetjmp(from->ctx, 0) == 0)
+		siglongjmp(to->ctx, 1);
+}
+
+/**
+ * The core part of the coroutines creation - this signal handler
+ * is run on a separate stack using sigaltstack. On an invokation
+ * it remembers its current context and jumps back to the
+ * coroutine constructor. Later the coroutine continues from here.
+ */
+static void
+coro_body(int signum)
+{
+	(void)signum;
+	struct coro *c = coro_this_ptr;
+	coro_this_ptr = NULL;
+	/*
+	 * On an invokation jump back to the constructor right
+	 * after remembering the context.
+	 */
+	if (sigsetjmp(c->ctx, 0) == 0)
+		siglongjmp(start_point, 1);
+	/*
+	 * If the execution is here, then the coroutine should
+	 * finaly start work.
+	 */
+	coro_this_ptr = c;
+	coro_body_run(c);
+}
+
+/**
+ * Prepare the context of a new coroutine so as the first switch
+ * into it would start coro_body_run() on @a stack.
+ */
+static void
+coro_context_init(struct coro *c, void *stack, size_t stack_size)
 {
-	struct coro *c = (struct coro *) malloc(sizeof(*c));
-	c->ret = 0;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = malloc(stack_size);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->is_finished = false;
-	c->switch_count = 0;
 	/*
 	 * SIGUSR2 is used. First of all, block new signals to be
 	 * able to set a new handler.
@@ -218,7 +1515,7 @@ coro_new(coro_f func, void *func_arg)
 		handle_error();
 	/* Create that new stack. */
 	stack_t oldst, newst;
-	newst.ss_sp = c->stack;
+	newst.ss_sp = stack;
 	newst.ss_size = stack_size;
 	newst.ss_flags = 0;
 	if (sigaltstack(&newst, &oldst) != 0)
@@ -251,8 +1548,733 @@ coro_new(coro_f func, void *func_arg)
 		handle_error();
 	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
 		handle_error();
+}
+
+#else /* !CORO_USE_SIGJMP */
+
+/**
+ * Save callee-saved registers of the current context on its
+ * stack, store the stack pointer into @a from_sp, then load
+ * @a to_sp and restore the registers saved there. The return
+ * happens already into the other context.
+ */
+void __attribute__((visibility("hidden")))
+coro_switch(void **from_sp, void *to_sp);
+
+#if defined(__x86_64__)
+
+/*
+ * System V AMD64 ABI: rbx, rbp, r12-r15 are callee-saved. The
+ * rest is either scratch or is saved by the compiler around the
+ * call.
+ */
+__asm__(
+	"	.text\n"
+	"	.globl coro_switch\n"
+	"	.hidden coro_switch\n"
+	"	.type coro_switch, @function\n"
+	"coro_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	"	.size coro_switch, .-coro_switch\n"
+);
+
+/** Saved registers + return address to the coroutine entry. */
+enum { CORO_FRAME_SLOTS = 7 };
+
+#elif defined(__aarch64__)
+
+/*
+ * AAPCS64: x19-x28, the frame pointer x29, the link register x30
+ * and the low halves of v8-v15 are callee-saved. The frame is
+ * 160 bytes rounded up to keep sp 16-byte aligned.
+ */
+__asm__(
+	"	.text\n"
+	"	.globl coro_switch\n"
+	"	.hidden coro_switch\n"
+	"	.type coro_switch, %function\n"
+	"coro_switch:\n"
+	"	sub sp, sp, #176\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x2, sp\n"
+	"	str x2, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #176\n"
+	"	ret\n"
+	"	.size coro_switch, .-coro_switch\n"
+);
+
+/** 176 byte frame, x30 is restored from the slot 11. */
+enum { CORO_FRAME_SLOTS = 22 };
+
+#endif
+
+static void
+coro_context_switch(struct coro *from, struct coro *to)
+{
+	coro_switch(&from->sp, to->sp);
+}
+
+/**
+ * The first switch into a coroutine "returns" here. The switcher
+ * has already set coro_this_ptr to the new coroutine.
+ */
+static void
+coro_entry(void)
+{
+	coro_body_run(coro_this_ptr);
+}
+
+/**
+ * Prepare the context of a new coroutine so as the first switch
+ * into it would start coro_body_run() on @a stack. It is a fake
+ * frame, looking like the one saved by coro_switch(), with all
+ * the registers zeroed and the return address set to the entry.
+ */
+static void
+coro_context_init(struct coro *c, void *stack, size_t stack_size)
+{
+	uintptr_t top = ((uintptr_t)stack + stack_size) & ~(uintptr_t)15;
+	void **sp = (void **)top;
+#if defined(__x86_64__)
+	/*
+	 * Fake return address of coro_entry() itself - on entry
+	 * rsp + 8 has to be 16-byte aligned as after a 'call'.
+	 */
+	*--sp = NULL;
+	sp -= CORO_FRAME_SLOTS;
+	memset(sp, 0, CORO_FRAME_SLOTS * sizeof(*sp));
+	sp[CORO_FRAME_SLOTS - 1] = (void *)coro_entry;
+#else
+	sp -= CORO_FRAME_SLOTS;
+	memset(sp, 0, CORO_FRAME_SLOTS * sizeof(*sp));
+	sp[11] = (void *)coro_entry;
+#endif
+	c->sp = sp;
+}
+
+#endif /* !CORO_USE_SIGJMP */
+
+void
+coro_attr_init(struct coro_attr *attr)
+{
+	attr->stack_size = CORO_STACK_SIZE_DEFAULT;
+	attr->name = NULL;
+	attr->priority = CORO_PRIO_DEFAULT;
+	attr->stack_probe = false;
+}
+
+struct coro *
+coro_new(coro_f func, void *func_arg)
+{
+	return coro_new_ex(func, func_arg, NULL);
+}
+
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, const struct coro_attr *attr)
+{
+	struct coro_attr default_attr;
+	if (attr == NULL) {
+		coro_attr_init(&default_attr);
+		attr = &default_attr;
+	}
+	struct coro *c = (struct coro *) malloc(sizeof(*c));
+	c->ret = 0;
+	size_t stack_size = attr->stack_size;
+	if (stack_size == 0)
+		stack_size = CORO_STACK_SIZE_DEFAULT;
+#ifdef CORO_USE_SIGJMP
+	if (stack_size < (size_t)SIGSTKSZ)
+		stack_size = SIGSTKSZ;
+#endif
+	int class_id = coro_stack_class(&stack_size);
+	c->stack_size = stack_size;
+	c->stack = coro_stack_new(stack_size, class_id);
+	c->stack_probe = attr->stack_probe;
+	if (c->stack_probe)
+		memset(c->stack, CORO_STACK_PAINT, stack_size);
+	if (attr->name != NULL) {
+		strncpy(c->name, attr->name, sizeof(c->name) - 1);
+		c->name[sizeof(c->name) - 1] = 0;
+	} else {
+		c->name[0] = 0;
+	}
+	c->priority = attr->priority;
+	if (c->priority < CORO_PRIO_MIN)
+		c->priority = CORO_PRIO_MIN;
+	else if (c->priority > CORO_PRIO_MAX)
+		c->priority = CORO_PRIO_MAX;
+	c->func = func;
+	c->func_arg = func_arg;
+	c->is_finished = false;
+	c->switch_count = 0;
+	c->ready_next = NULL;
+	c->wakeup_time = 0;
+	c->timer_idx = -1;
+	c->is_sleep = false;
+	c->owner = NULL;
+	c->cpu_time = 0;
+	c->wait_time = 0;
+	c->max_slice = 0;
+	c->slice_start = 0;
+	c->ready_since = 0;
+	c->quantum = -1;
+	c->slice_deadline = 0;
+	coro_context_init(c, c->stack, c->stack_size);
 
 	/* Now scheduler can work with that coroutine. */
+	if (coro_mt.is_enabled) {
+		pthread_mutex_lock(&coro_mt.lock);
+		coro_list_add(c);
+		pthread_mutex_unlock(&coro_mt.lock);
+		c->state = CORO_STATE_READY;
+		coro_mt_make_ready(c);
+		return c;
+	}
 	coro_list_add(c);
+	coro_ready_push(c);
 	return c;
 }
+
+/** Make ready the sleeping coroutines woken up by other threads. */
+static void
+coro_worker_mailbox_process(struct coro_worker *w)
+{
+	if (__atomic_load_n(&w->mailbox, __ATOMIC_ACQUIRE) == NULL)
+		return;
+	pthread_mutex_lock(&w->mailbox_lock);
+	struct coro *c = w->mailbox;
+	w->mailbox = NULL;
+	pthread_mutex_unlock(&w->mailbox_lock);
+	while (c != NULL) {
+		struct coro *next = c->ready_next;
+		if (c->timer_idx >= 0)
+			coro_timer_delete(c);
+		__atomic_store_n(&c->state, CORO_STATE_READY, __ATOMIC_RELEASE);
+		coro_deque_push(&w->deque, c);
+		c = next;
+	}
+}
+
+/** Find work: own deque, then the inject queue, then steal. */
+static struct coro *
+coro_worker_next(struct coro_worker *w)
+{
+	struct coro *c = coro_deque_steal(&w->deque);
+	if (c != NULL)
+		return c;
+	if (__atomic_load_n(&coro_mt.inject_head, __ATOMIC_ACQUIRE) != NULL) {
+		pthread_mutex_lock(&coro_mt.lock);
+		c = coro_mt.inject_head;
+		if (c != NULL) {
+			coro_mt.inject_head = c->ready_next;
+			if (coro_mt.inject_head == NULL)
+				coro_mt.inject_tail = NULL;
+		}
+		pthread_mutex_unlock(&coro_mt.lock);
+		if (c != NULL)
+			return c;
+	}
+	int count = coro_mt.worker_count;
+	for (int i = 0; i < 2 * count; ++i) {
+		struct coro_worker *victim =
+			&coro_mt.workers[rand_r(&w->seed) % count];
+		if (victim == w)
+			continue;
+		c = coro_deque_steal(&victim->deque);
+		if (c != NULL)
+			return c;
+	}
+	return NULL;
+}
+
+/** Nothing to do - wait for new work, a timer or 1ms at most. */
+static void
+coro_worker_idle(void)
+{
+	double deadline = coro_clock() + 0.001;
+	if (coro_timers.count > 0 && coro_timers.data[0]->wakeup_time < deadline)
+		deadline = coro_timers.data[0]->wakeup_time;
+	if (coro_io_has_waiters()) {
+		/*
+		 * Only this worker polls its epoll, so wait for the
+		 * events instead. New work is noticed after 1ms.
+		 */
+		__atomic_add_fetch(&coro_mt.idle_count, 1, __ATOMIC_ACQ_REL);
+		coro_io_poll(coro_io_timeout(deadline));
+		__atomic_sub_fetch(&coro_mt.idle_count, 1, __ATOMIC_ACQ_REL);
+		return;
+	}
+	struct timespec ts;
+	ts.tv_sec = (time_t)deadline;
+	ts.tv_nsec = (long)((deadline - ts.tv_sec) * 1e9);
+	pthread_mutex_lock(&coro_mt.lock);
+	if (coro_mt.inject_head == NULL && !coro_mt.is_stopping) {
+		__atomic_add_fetch(&coro_mt.idle_count, 1, __ATOMIC_ACQ_REL);
+		pthread_cond_timedwait(&coro_mt.idle_cond, &coro_mt.lock, &ts);
+		__atomic_sub_fetch(&coro_mt.idle_count, 1, __ATOMIC_ACQ_REL);
+	}
+	pthread_mutex_unlock(&coro_mt.lock);
+}
+
+/**
+ * A coroutine has switched back to the worker scheduler. Now its
+ * stack is free, and it can be published to the other threads
+ * according to what it wants.
+ */
+static void
+coro_worker_put(struct coro_worker *w, struct coro *c)
+{
+	enum coro_state state = __atomic_load_n(&c->state, __ATOMIC_ACQUIRE);
+	if (state == CORO_STATE_READY) {
+		coro_deque_push(&w->deque, c);
+		return;
+	}
+	if (state == CORO_STATE_FINISHED) {
+		pthread_mutex_lock(&coro_mt.lock);
+		coro_list_delete(c);
+		coro_dead_push(c);
+		pthread_cond_signal(&coro_mt.dead_cond);
+		pthread_mutex_unlock(&coro_mt.lock);
+		return;
+	}
+	assert(state == CORO_STATE_SUSPENDING ||
+	       state == CORO_STATE_WAKEUP_PENDING);
+	if (state == CORO_STATE_SUSPENDING) {
+		enum coro_state new_state = CORO_STATE_SUSPENDED;
+		if (c->is_sleep) {
+			c->owner = w;
+			coro_timer_add(c);
+			new_state = CORO_STATE_SLEEPING;
+		}
+		if (__atomic_compare_exchange_n(&c->state, &state, new_state,
+						false, __ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE))
+			return;
+		if (c->is_sleep)
+			coro_timer_delete(c);
+	}
+	/* Woken up before managed to fall asleep. */
+	assert(state == CORO_STATE_WAKEUP_PENDING);
+	__atomic_store_n(&c->state, CORO_STATE_READY, __ATOMIC_RELEASE);
+	coro_deque_push(&w->deque, c);
+}
+
+static void *
+coro_worker_f(void *arg)
+{
+	struct coro_worker *w = arg;
+	coro_worker_this = w;
+	coro_sched_init();
+	is_sched_waiting = true;
+	while (true) {
+		coro_worker_mailbox_process(w);
+		if (coro_io_has_waiters())
+			coro_io_poll(0);
+		coro_timers_process();
+		struct coro *c = coro_worker_next(w);
+		if (c == NULL) {
+			if (__atomic_load_n(&coro_mt.is_stopping,
+					    __ATOMIC_ACQUIRE))
+				break;
+			coro_worker_idle();
+			continue;
+		}
+		__atomic_store_n(&c->state, CORO_STATE_RUNNING,
+				 __ATOMIC_RELAXED);
+		coro_yield_to(c);
+		coro_worker_put(w, c);
+	}
+	coro_worker_this = NULL;
+	if (coro_io.epfd >= 0)
+		close(coro_io.epfd);
+	coro_stack_pool_configure(0, false, true);
+	free(coro_timers.data);
+	coro_timers.data = NULL;
+	coro_timers.capacity = 0;
+	return NULL;
+}
+
+int
+coro_sched_start_workers(int count)
+{
+	if (count < 1 || coro_mt.is_enabled || coro_list != NULL)
+		return -1;
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&coro_mt.idle_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&coro_mt.dead_cond, NULL);
+	coro_mt.workers = calloc(count, sizeof(*coro_mt.workers));
+	coro_mt.worker_count = count;
+	coro_mt.is_stopping = false;
+	coro_mt.idle_count = 0;
+	for (int i = 0; i < count; ++i) {
+		struct coro_worker *w = &coro_mt.workers[i];
+		coro_deque_create(&w->deque);
+		pthread_mutex_init(&w->mailbox_lock, NULL);
+		w->seed = i + 1;
+	}
+	coro_mt.is_enabled = true;
+	for (int i = 0; i < count; ++i) {
+		struct coro_worker *w = &coro_mt.workers[i];
+		if (pthread_create(&w->thread, NULL, coro_worker_f, w) != 0)
+			handle_error();
+	}
+	return 0;
+}
+
+void
+coro_sched_stop_workers(void)
+{
+	if (!coro_mt.is_enabled)
+		return;
+	pthread_mutex_lock(&coro_mt.lock);
+	__atomic_store_n(&coro_mt.is_stopping, true, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&coro_mt.idle_cond);
+	pthread_mutex_unlock(&coro_mt.lock);
+	for (int i = 0; i < coro_mt.worker_count; ++i) {
+		struct coro_worker *w = &coro_mt.workers[i];
+		pthread_join(w->thread, NULL);
+		coro_deque_destroy(&w->deque);
+		pthread_mutex_destroy(&w->mailbox_lock);
+	}
+	free(coro_mt.workers);
+	coro_mt.workers = NULL;
+	coro_mt.worker_count = 0;
+	pthread_cond_destroy(&coro_mt.idle_cond);
+	pthread_cond_destroy(&coro_mt.dead_cond);
+	coro_mt.is_enabled = false;
+}
+
+/**
+ * A coroutine blocked on a mutex, a condition or a channel. Lives
+ * on the waiter's stack. The waker does everything under the
+ * lock of the primitive, including the wakeup. The waiter takes
+ * the lock again before leaving, so the waker is done with it by
+ * then.
+ */
+struct coro_waiter {
+	struct coro *coro;
+	struct coro_waiter *next;
+	/** A value passed through a channel. */
+	void *value;
+	/** Result of the wait: 0 or -1, if the channel is closed. */
+	int rc;
+	/** Set by the waker, the waiter can go. */
+	bool is_done;
+};
+
+struct coro_wait_queue {
+	struct coro_waiter *head;
+	struct coro_waiter *tail;
+};
+
+static void
+coro_wait_queue_push(struct coro_wait_queue *q, struct coro_waiter *w)
+{
+	w->next = NULL;
+	if (q->tail == NULL)
+		q->head = w;
+	else
+		q->tail->next = w;
+	q->tail = w;
+}
+
+static struct coro_waiter *
+coro_wait_queue_pop(struct coro_wait_queue *q)
+{
+	struct coro_waiter *w = q->head;
+	if (w == NULL)
+		return NULL;
+	q->head = w->next;
+	if (q->head == NULL)
+		q->tail = NULL;
+	return w;
+}
+
+/**
+ * Put the current coroutine into the queue and sleep until it is
+ * released by coro_waiter_done(). @a lock should be taken, and it
+ * is released on return. Not inlined, so the current coroutine is
+ * looked up in the right thread, when a caller waits twice.
+ */
+static void __attribute__((noinline))
+coro_wait(struct coro_wait_queue *q, struct coro_waiter *w, int *lock)
+{
+	w->coro = coro_this_ptr;
+	w->is_done = false;
+	w->rc = 0;
+	coro_wait_queue_push(q, w);
+	do {
+		coro_suspend_unlock(lock);
+		/* A wakeup can be spurious, like from coro_wakeup(). */
+		coro_spin_lock(lock);
+	} while (!w->is_done);
+	coro_spin_unlock(lock);
+}
+
+/** Release a waiter. The primitive lock should be taken. */
+static void
+coro_waiter_done(struct coro_waiter *w, int rc)
+{
+	w->rc = rc;
+	w->is_done = true;
+	coro_wakeup(w->coro);
+}
+
+struct coro_mutex {
+	int lock;
+	bool is_locked;
+	struct coro_wait_queue waiters;
+};
+
+struct coro_mutex *
+coro_mutex_new(void)
+{
+	return calloc(1, sizeof(struct coro_mutex));
+}
+
+void
+coro_mutex_delete(struct coro_mutex *m)
+{
+	assert(m->waiters.head == NULL);
+	free(m);
+}
+
+void
+coro_mutex_lock(struct coro_mutex *m)
+{
+	coro_spin_lock(&m->lock);
+	if (!m->is_locked) {
+		m->is_locked = true;
+		coro_spin_unlock(&m->lock);
+		return;
+	}
+	/* The unlocker hands the ownership over right to us. */
+	struct coro_waiter w;
+	coro_wait(&m->waiters, &w, &m->lock);
+}
+
+bool
+coro_mutex_trylock(struct coro_mutex *m)
+{
+	coro_spin_lock(&m->lock);
+	bool is_acquired = !m->is_locked;
+	m->is_locked = true;
+	coro_spin_unlock(&m->lock);
+	return is_acquired;
+}
+
+void
+coro_mutex_unlock(struct coro_mutex *m)
+{
+	coro_spin_lock(&m->lock);
+	assert(m->is_locked);
+	struct coro_waiter *w = coro_wait_queue_pop(&m->waiters);
+	if (w != NULL)
+		coro_waiter_done(w, 0);
+	else
+		m->is_locked = false;
+	coro_spin_unlock(&m->lock);
+}
+
+struct coro_cond {
+	int lock;
+	struct coro_wait_queue waiters;
+};
+
+struct coro_cond *
+coro_cond_new(void)
+{
+	return calloc(1, sizeof(struct coro_cond));
+}
+
+void
+coro_cond_delete(struct coro_cond *c)
+{
+	assert(c->waiters.head == NULL);
+	free(c);
+}
+
+void
+coro_cond_wait(struct coro_cond *c, struct coro_mutex *m)
+{
+	struct coro_waiter w;
+	coro_spin_lock(&c->lock);
+	/*
+	 * The mutex is released under the condition lock, so a
+	 * signal sent after the unlock finds this waiter.
+	 */
+	coro_mutex_unlock(m);
+	coro_wait(&c->waiters, &w, &c->lock);
+	coro_mutex_lock(m);
+}
+
+void
+coro_cond_signal(struct coro_cond *c)
+{
+	coro_spin_lock(&c->lock);
+	struct coro_waiter *w = coro_wait_queue_pop(&c->waiters);
+	if (w != NULL)
+		coro_waiter_done(w, 0);
+	coro_spin_unlock(&c->lock);
+}
+
+void
+coro_cond_broadcast(struct coro_cond *c)
+{
+	coro_spin_lock(&c->lock);
+	struct coro_waiter *w;
+	while ((w = coro_wait_queue_pop(&c->waiters)) != NULL)
+		coro_waiter_done(w, 0);
+	coro_spin_unlock(&c->lock);
+}
+
+struct coro_channel {
+	int lock;
+	bool is_closed;
+	/** Ring buffer of the messages. */
+	void **buf;
+	int capacity;
+	int head;
+	int count;
+	/**
+	 * Senders wait only when the buffer is full, receivers -
+	 * only when it is empty. So there are never both.
+	 */
+	struct coro_wait_queue senders;
+	struct coro_wait_queue receivers;
+};
+
+struct coro_channel *
+coro_channel_new(int capacity)
+{
+	if (capacity < 0)
+		return NULL;
+	struct coro_channel *ch = calloc(1, sizeof(*ch));
+	ch->capacity = capacity;
+	if (capacity > 0)
+		ch->buf = malloc(sizeof(*ch->buf) * capacity);
+	return ch;
+}
+
+void
+coro_channel_delete(struct coro_channel *ch)
+{
+	assert(ch->senders.head == NULL && ch->receivers.head == NULL);
+	free(ch->buf);
+	free(ch);
+}
+
+int
+coro_channel_send(struct coro_channel *ch, void *value)
+{
+	coro_spin_lock(&ch->lock);
+	if (ch->is_closed) {
+		coro_spin_unlock(&ch->lock);
+		return -1;
+	}
+	struct coro_waiter *r = coro_wait_queue_pop(&ch->receivers);
+	if (r != NULL) {
+		/* A receiver waits, so the buffer is empty. */
+		r->value = value;
+		coro_waiter_done(r, 0);
+		coro_spin_unlock(&ch->lock);
+		return 0;
+	}
+	if (ch->count < ch->capacity) {
+		ch->buf[(ch->head + ch->count++) % ch->capacity] = value;
+		coro_spin_unlock(&ch->lock);
+		return 0;
+	}
+	struct coro_waiter w;
+	w.value = value;
+	coro_wait(&ch->senders, &w, &ch->lock);
+	return w.rc;
+}
+
+int
+coro_channel_recv(struct coro_channel *ch, void **value)
+{
+	coro_spin_lock(&ch->lock);
+	struct coro_waiter *s;
+	if (ch->count > 0) {
+		*value = ch->buf[ch->head];
+		ch->head = (ch->head + 1) % ch->capacity;
+		--ch->count;
+		/* Move a waiting sender's message into the freed slot. */
+		s = coro_wait_queue_pop(&ch->senders);
+		if (s != NULL) {
+			ch->buf[(ch->head + ch->count++) % ch->capacity] =
+				s->value;
+			coro_waiter_done(s, 0);
+		}
+		coro_spin_unlock(&ch->lock);
+		return 0;
+	}
+	s = coro_wait_queue_pop(&ch->senders);
+	if (s != NULL) {
+		/* Unbuffered channel - take right from the sender. */
+		*value = s->value;
+		coro_waiter_done(s, 0);
+		coro_spin_unlock(&ch->lock);
+		return 0;
+	}
+	if (ch->is_closed) {
+		coro_spin_unlock(&ch->lock);
+		return -1;
+	}
+	struct coro_waiter w;
+	coro_wait(&ch->receivers, &w, &ch->lock);
+	if (w.rc == 0)
+		*value = w.value;
+	return w.rc;
+}
+
+void
+coro_channel_close(struct coro_channel *ch)
+{
+	coro_spin_lock(&ch->lock);
+	ch->is_closed = true;
+	struct coro_waiter *w;
+	while ((w = coro_wait_queue_pop(&ch->senders)) != NULL)
+		coro_waiter_done(w, -1);
+	while ((w = coro_wait_queue_pop(&ch->receivers)) != NULL)
+		coro_waiter_done(w, -1);
+	coro_spin_unlock(&ch->lock);
+}
@@ -1,14 +1,76 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 
 struct coro;
 typedef int (*coro_f)(void *);
 
+enum {
+	/** Max length of a coroutine name, including 0 byte. */
+	CORO_NAME_MAX = 32,
+	CORO_PRIO_MIN = -3,
+	CORO_PRIO_DEFAULT = 0,
+	CORO_PRIO_MAX = 3,
+};
+
+/** Coroutine attributes, see coro_new_ex(). */
+struct coro_attr {
+	/**
+	 * Stack size in bytes, 1 MiB by default. It is rounded up
+	 * to a power of 2 pages.
+	 */
+	size_t stack_size;
+	/** Name for debug, copied into the coroutine. Can be NULL. */
+	const char *name;
+	/**
+	 * Priority in the range [CORO_PRIO_MIN, CORO_PRIO_MAX].
+	 * Ready coroutines with a bigger priority always run
+	 * first. The ones with the same priority take turns.
+	 */
+	int priority;
+	/**
+	 * Fill the stack with a pattern on creation, so as
+	 * coro_stack_usage() could find how deep it was used. It
+	 * costs a touch of every stack page.
+	 */
+	bool stack_probe;
+};
+
+/** Set the default attributes. */
+void
+coro_attr_init(struct coro_attr *attr);
+
 /** Make current context scheduler. */
 void
 coro_sched_init(void);
 
+/**
+ * Switch the scheduler into the M:N mode: the coroutines are run
+ * by @a count worker threads instead of the calling one. Each
+ * worker has its own queue of ready coroutines, and the idle ones
+ * steal from the others. The calling thread only creates the
+ * coroutines and waits for them in coro_sched_wait().
+ *
+ * Should be called after coro_sched_init() and before any
+ * coroutine is created. The priorities are ignored in this mode,
+ * and the stack pool is per thread.
+ * @retval 0 Success.
+ * @retval -1 Bad count, or there are coroutines already.
+ */
+int
+coro_sched_start_workers(int count);
+
+/**
+ * Stop the worker threads and return to the single thread mode.
+ * All the coroutines should be finished and waited for.
+ */
+void
+coro_sched_stop_workers(void);
+
 /**
  * Block until any coroutine has finished. It is returned. NULl,
  * if no coroutines.
@@ -20,6 +82,21 @@ coro_sched_wait(void);
 struct coro *
 coro_this(void);
 
+/**
+ * Turn on or off the profiling of the coroutines, see
+ * coro_stats(). It costs a couple of clock reads per switch. Off
+ * by default.
+ */
+void
+coro_sched_set_profiling(bool is_enabled);
+
+/**
+ * Print a table of the not finished coroutines with their state
+ * and profile, to find who hogs the CPU or waits for too long.
+ */
+void
+coro_sched_dump(FILE *out);
+
 /**
  * Create a new coroutine. It is not started, just added to the
  * scheduler.
@@ -27,6 +104,30 @@ coro_this(void);
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/**
+ * Same as coro_new(), but with the given attributes. NULL @a attr
+ * means the defaults.
+ */
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, const struct coro_attr *attr);
+
+/** Name of the coroutine. Empty string, if it wasn't given. */
+const char *
+coro_name(const struct coro *c);
+
+/** Priority of the coroutine. */
+int
+coro_priority(const struct coro *c);
+
+/**
+ * High-water mark of the coroutine stack usage in bytes. It is
+ * how deep the stack was ever used, not the current depth. The
+ * coroutine should be created with the stack_probe attribute,
+ * otherwise -1 is returned.
+ */
+long long
+coro_stack_usage(const struct coro *c);
+
 /** Return status of the coroutine. */
 int
 coro_status(const struct coro *c);
@@ -34,6 +135,23 @@ coro_status(const struct coro *c);
 long long
 coro_switch_count(const struct coro *c);
 
+/**
+ * Profile of a coroutine. The times are in nanoseconds and are
+ * counted only while the profiling is on.
+ */
+struct coro_stats {
+	/** CPU time of the thread spent in the coroutine. */
+	long long cpu_time;
+	/** Wall time the coroutine was ready, but not running. */
+	long long wait_time;
+	/** CPU time of the longest run without a switch. */
+	long long max_slice;
+	long long switch_count;
+};
+
+void
+coro_stats(const struct coro *c, struct coro_stats *stats);
+
 /** Check if the coroutine has finished. */
 bool
 coro_is_finished(const struct coro *c);
@@ -42,6 +160,215 @@ coro_is_finished(const struct coro *c);
 void
 coro_delete(struct coro *c);
 
-/** Switch to another not finished coroutine. */
+/**
+ * Switch to the next ready coroutine. The current one stays
+ * ready and gets its turn again after the others.
+ */
 void
 coro_yield(void);
+
+/**
+ * Stop the current coroutine until somebody calls coro_wakeup()
+ * on it. It is not scheduled at all meanwhile.
+ */
+void
+coro_suspend(void);
+
+/**
+ * Make a suspended or sleeping coroutine ready to run. Does
+ * nothing, if it is running, ready or finished.
+ */
+void
+coro_wakeup(struct coro *c);
+
+/**
+ * Suspend the current coroutine for the given time. It can be
+ * woken up earlier by coro_wakeup().
+ */
+void
+coro_sleep(double seconds);
+
+/**
+ * Give the current coroutine a time slice of @a us microseconds.
+ * The slice starts anew each time the coroutine is switched in.
+ * Negative means no limit, which is the default.
+ */
+void
+coro_set_quantum(long long us);
+
+/**
+ * Check if the time slice of the current coroutine is over. Lets
+ * the caller do something right before it yields, like stop its
+ * own timers. Just a CPU counter read, no syscalls.
+ */
+bool
+coro_is_expired(void);
+
+/**
+ * Yield, if the time slice of the current coroutine is over. It
+ * is cheap enough to be called on each step of a long loop: just
+ * a CPU counter read, no syscalls.
+ * @retval true The coroutine has yielded.
+ */
+bool
+coro_yield_if_expired(void);
+
+/** Coroutine stack pool statistics. */
+struct coro_stack_pool_stats {
+	/** Stacks reused from the pool. */
+	long long hits;
+	/** Stacks mapped anew, because the pool was empty. */
+	long long misses;
+	/** Free stacks in the pool right now. */
+	int cached;
+};
+
+/**
+ * Configure the pool of the stacks freed by coro_delete() in the
+ * calling thread.
+ * @param max_cached How many free stacks to keep for reuse. The
+ *        extra ones are unmapped, including the already cached.
+ * @param release_pages Drop the pages of a stack returned to the
+ *        pool with madvise(MADV_DONTNEED). It saves RSS, but the
+ *        next user of the stack faults the pages in again.
+ * @param use_guard Protect a guard page below each new stack. On
+ *        by default. Each guard costs a kernel VMA, and their
+ *        count is limited by vm.max_map_count (65530 usually).
+ *        So for much more coroutines alive at once it has to be
+ *        turned off.
+ */
+void
+coro_stack_pool_configure(int max_cached, bool release_pages, bool use_guard);
+
+/** Get the stack pool statistics of the calling thread. */
+void
+coro_stack_pool_stats(struct coro_stack_pool_stats *stats);
+
+enum {
+	CORO_EVENT_READ = 1,
+	CORO_EVENT_WRITE = 2,
+};
+
+/**
+ * Suspend the current coroutine until @a fd is ready for the
+ * @a events - a mask of CORO_EVENT_*. The other coroutines work
+ * meanwhile. Outside of a coroutine just blocks in poll().
+ * Regular files are considered always ready. Any number of
+ * coroutines can wait on the same fd, for the same or different
+ * events, all of them are woken up when it is ready.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+coro_wait_fd(int fd, int events);
+
+/*
+ * The functions below are like their system analogues, but if the
+ * fd is not ready, they suspend the current coroutine until it is,
+ * instead of blocking the whole thread. The fds have to be in the
+ * non-blocking mode (O_NONBLOCK), otherwise the syscalls block
+ * anyway.
+ */
+
+ssize_t
+coro_read(int fd, void *buf, size_t count);
+
+/** Can write less than @a count, same as write(). */
+ssize_t
+coro_write(int fd, const void *buf, size_t count);
+
+/** The accepted socket is already non-blocking. */
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+
+int
+coro_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+
+/*
+ * Synchronization of the coroutines. When a coroutine has to
+ * wait, it is suspended and costs nothing until the resource is
+ * handed over right to it. No syscalls are done. The waiting
+ * calls should be made from a coroutine. They work in the M:N
+ * mode too.
+ */
+
+struct coro_mutex;
+
+struct coro_mutex *
+coro_mutex_new(void);
+
+/** The mutex should be unlocked and have no waiters. */
+void
+coro_mutex_delete(struct coro_mutex *m);
+
+/** Lock the mutex. The waiters get it in the FIFO order. */
+void
+coro_mutex_lock(struct coro_mutex *m);
+
+/** Lock the mutex, if it is free. Never waits. */
+bool
+coro_mutex_trylock(struct coro_mutex *m);
+
+/** Unlock the mutex, or pass it to the first waiter. */
+void
+coro_mutex_unlock(struct coro_mutex *m);
+
+struct coro_cond;
+
+struct coro_cond *
+coro_cond_new(void);
+
+void
+coro_cond_delete(struct coro_cond *c);
+
+/**
+ * Unlock @a m, wait for a signal, lock @a m again. Same as with
+ * pthread, the condition should be checked in a loop.
+ */
+void
+coro_cond_wait(struct coro_cond *c, struct coro_mutex *m);
+
+/** Wake up one waiter, if any. */
+void
+coro_cond_signal(struct coro_cond *c);
+
+/** Wake up all the waiters. */
+void
+coro_cond_broadcast(struct coro_cond *c);
+
+/** Bounded multi-producer multi-consumer queue of pointers. */
+struct coro_channel;
+
+/**
+ * Create a channel for @a capacity messages. With 0 capacity each
+ * send waits for a receiver. NULL, if the capacity is negative.
+ */
+struct coro_channel *
+coro_channel_new(int capacity);
+
+/** The channel should have no waiters. */
+void
+coro_channel_delete(struct coro_channel *ch);
+
+/**
+ * Send a message. Waits, while the channel is full.
+ * @retval 0 Success.
+ * @retval -1 The channel is closed.
+ */
+int
+coro_channel_send(struct coro_channel *ch, void *value);
+
+/**
+ * Receive a message. Waits, while the channel is empty.
+ * @retval 0 Success.
+ * @retval -1 The channel is closed and empty.
+ */
+int
+coro_channel_recv(struct coro_channel *ch, void **value);
+
+/**
+ * Close the channel. Waiting senders fail, receivers fail after
+ * the messages left in the buffer are consumed.
+ */
+void
+coro_channel_close(struct coro_channel *ch);
@@ -0,0 +1,158 @@
+#include "pmerge.h"
+#include "thread_pool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/** A part of the output, merged and written by one task. */
+struct pmerge_chunk {
+	const struct sort_run *runs;
+	int count;
+	/** Ranks of the first and past the last number. */
+	size_t begin;
+	size_t end;
+	/** The whole merged output. */
+	int *out;
+	/** Bytes of the chunk in the file. */
+	size_t file_size;
+	off_t offset;
+	int fd;
+	enum intfile_format format;
+	int rc;
+	int error;
+};
+
+static void *
+pmerge_merge_f(void *arg)
+{
+	struct pmerge_chunk *c = arg;
+	size_t *splits = malloc(sizeof(*splits) * 2 * c->count);
+	struct sort_run *parts = malloc(sizeof(*parts) * c->count);
+	if (splits == NULL || parts == NULL)
+		abort();
+	size_t *ends = splits + c->count;
+	sort_merge_k_split(c->runs, c->count, c->begin, splits);
+	sort_merge_k_split(c->runs, c->count, c->end, ends);
+	for (int i = 0; i < c->count; ++i) {
+		parts[i].data = c->runs[i].data + splits[i];
+		parts[i].size = ends[i] - splits[i];
+	}
+	int *out = c->out + c->begin;
+	size_t size = c->end - c->begin;
+	sort_merge_k(parts, c->count, out);
+	if (c->format == INTFILE_TEXT)
+		c->file_size = intfile_text_size(out, size);
+	else
+		c->file_size = size * sizeof(int);
+	free(parts);
+	free(splits);
+	return NULL;
+}
+
+static void *
+pmerge_write_f(void *arg)
+{
+	struct pmerge_chunk *c = arg;
+	struct intfile_writer w;
+	intfile_writer_create(&w, c->fd, c->format);
+	intfile_writer_seek(&w, c->offset);
+	c->rc = intfile_writer_put(&w, c->out + c->begin, c->end - c->begin);
+	if (c->rc == 0)
+		c->rc = intfile_writer_flush(&w);
+	c->error = errno;
+	intfile_writer_destroy(&w);
+	return NULL;
+}
+
+/** Run the function on each chunk in the pool, wait for all. */
+static void
+pmerge_run(struct thread_pool *pool, struct pmerge_chunk *chunks,
+	   int chunk_count, thread_task_f func)
+{
+	struct thread_task **tasks = malloc(sizeof(*tasks) * chunk_count);
+	if (tasks == NULL)
+		abort();
+	for (int i = 0; i < chunk_count; ++i) {
+		thread_task_new(&tasks[i], func, &chunks[i]);
+		if (thread_pool_push_task(pool, tasks[i]) != 0)
+			abort();
+	}
+	for (int i = 0; i < chunk_count; ++i) {
+		void *result;
+		thread_task_join(tasks[i], &result);
+		thread_task_delete(tasks[i]);
+	}
+	free(tasks);
+}
+
+int
+pmerge_write(const struct sort_run *runs, int count, int thread_count,
+	     const char *path, enum intfile_format format)
+{
+	size_t total = 0;
+	for (int i = 0; i < count; ++i)
+		total += runs[i].size;
+	int *out = malloc(sizeof(*out) * (total + 1));
+	if (out == NULL)
+		abort();
+	if (thread_count <= 1 || total < (size_t)thread_count) {
+		sort_merge_k(runs, count, out);
+		int rc = intfile_write(path, out, total, format);
+		free(out);
+		return rc;
+	}
+	if (thread_count > TPOOL_MAX_THREADS)
+		thread_count = TPOOL_MAX_THREADS;
+	struct thread_pool *pool;
+	if (thread_pool_new(thread_count, &pool) != 0)
+		abort();
+	struct pmerge_chunk *chunks = malloc(sizeof(*chunks) * thread_count);
+	if (chunks == NULL)
+		abort();
+	for (int i = 0; i < thread_count; ++i) {
+		struct pmerge_chunk *c = &chunks[i];
+		c->runs = runs;
+		c->count = count;
+		c->begin = total * i / thread_count;
+		c->end = total * (i + 1) / thread_count;
+		c->out = out;
+		c->format = format;
+	}
+	pmerge_run(pool, chunks, thread_count, pmerge_merge_f);
+
+	int rc = 0;
+	int saved_errno;
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		rc = -1;
+		goto out;
+	}
+	/* The chunk sizes are known, so are their places in the file. */
+	off_t offset = 0;
+	for (int i = 0; i < thread_count; ++i) {
+		chunks[i].fd = fd;
+		chunks[i].offset = offset;
+		offset += chunks[i].file_size;
+	}
+	pmerge_run(pool, chunks, thread_count, pmerge_write_f);
+	for (int i = 0; i < thread_count && rc == 0; ++i) {
+		if (chunks[i].rc != 0) {
+			rc = -1;
+			errno = chunks[i].error;
+		}
+	}
+	saved_errno = errno;
+	if (close(fd) != 0 && rc == 0)
+		rc = -1;
+	else
+		errno = saved_errno;
+out:
+	saved_errno = errno;
+	thread_pool_delete(pool);
+	free(chunks);
+	free(out);
+	errno = saved_errno;
+	return rc;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "intfile.h"
+#include "sort.h"
+
+/**
+ * Parallel final merge of the sorted runs into a file. The output
+ * is cut into equal chunks by the co-ranks of the runs, see
+ * sort_merge_k_split(). Each chunk is merged by a thread pool task
+ * with no synchronization, then each one is written into its own
+ * part of the file with pwrite().
+ */
+
+/**
+ * Merge the runs and write them to a new file. One thread means
+ * the plain sort_merge_k() and intfile_write().
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+pmerge_write(const struct sort_run *runs, int count, int thread_count,
+	     const char *path, enum intfile_format format);
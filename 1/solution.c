@@ -2,38 +2,89 @@
 #include <stdlib.h>
 #include <string.h>
 #include "libcoro.h"
+#include "intfile.h"
+#include "extsort.h"
+#include "pmerge.h"
+#include "sort.h"
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 /**
  * You can compile and run this code using the commands:
  *
- * $> gcc solution.c libcoro.c
- * $> ./a.out
+ * $> gcc -pthread -I ../4 solution.c libcoro.c intfile.c extsort.c pmerge.c sort.c ../4/thread_pool.c
+ * $> ./a.out [--mmap] [--binary] [--mem-limit=SIZE[K|M|G]] [--procs=N] [--threads=N] [--split] [--algo=merge|radix|hybrid] [--profile] LATENCY COROUTINES FILE...
+ *
+ * The result goes to result.txt, or to result.bin as raw
+ * little-endian int32 with --binary.
+ *
+ * With --mem-limit the files may not fit into memory. The input is
+ * cut into runs, which the coroutines sort and spill into temporary
+ * files, then the runs are merged from the disk.
+ *
+ * With --procs=N the files are sorted by N forked workers, each one
+ * runs its own coroutines. The workers parse and sort the numbers
+ * right in a MAP_SHARED area, where the parent merges them from.
+ *
+ * With --threads=N the sorted files are merged and written by N
+ * threads, each one takes an equal part of the result.
+ *
+ * The coroutines take the files biggest first. With --split the
+ * files bigger than a fair share of one coroutine are cut into
+ * parts, sorted by different coroutines.
+ *
+ * With --profile the library measures the coroutine switches: the
+ * work time, the waits and the longest slice of each coroutine.
  */
 
 
 typedef unsigned long long ull;
 
+/* How much of a mapped file is parsed between the yield checks. */
+#define LOAD_CHUNK (64 * 1024)
+/* Files are not split into the parts smaller than that, numbers. */
+#define SPLIT_MIN (64 * 1024)
+
 struct my_context {
     char *filename;
     int* arr;
     int size;
-    bool sorted;
+    /* Room in a preset arr for the mmap loader, 0 if it allocates. */
+    size_t capacity;
+    /* File size, the estimate of the work before it is loaded. */
+    size_t bytes;
+};
 
+/* A file or a part of it, sorted by one coroutine. */
+struct work_item {
+    struct my_context *file;
+    int begin;
+    /* -1 till a mapped file is loaded, then its size. */
+    int end;
+    size_t weight;
 };
 
 struct works{
     struct my_context **files;
     int sz;
     ull lat;
+    bool use_mmap;
+    sort_f sort;
+    /* The library measures the work, see struct work_timer. */
+    bool is_profiling;
+    /* The work queue, biggest first. A claim takes the next one. */
+    struct work_item *items;
+    int item_count;
+    int next_item;
 };
 
 struct coro_data{
     struct works *data;
     int coro_id;
-
-    struct timespec start;
-    ull total_time;
 };
 
 static struct coro_data * coro_data_new(struct works * data, int id) {
@@ -43,38 +94,223 @@ static struct coro_data * coro_data_new(struct works * data, int id) {
     return ctx;
 }
 
+ull to_ms(struct timespec tm){
+    return (ull) tm.tv_sec*1000000+(ull)tm.tv_nsec/1000;
+}
+
+/*
+ * Work time of a coroutine. The timer is stopped before each yield
+ * and started again right after it, so the waits are not counted.
+ * The clock is read only around the real yields. With --profile
+ * the timer is off, the library measures the work then.
+ */
+struct work_timer {
+    struct timespec start;
+    ull total;
+    bool is_on;
+};
+
+static void
+work_timer_start(struct work_timer *t)
+{
+    if (t->is_on)
+        clock_gettime(CLOCK_MONOTONIC, &t->start);
+}
+
+static void
+work_timer_stop(struct work_timer *t)
+{
+    if (!t->is_on)
+        return;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    t->total += to_ms(end) - to_ms(t->start);
+}
+
+static void
+work_yield(struct work_timer *t)
+{
+    work_timer_stop(t);
+    coro_yield();
+    work_timer_start(t);
+}
+
+/*
+ * coro_yield_if_expired(), which does not count the wait as work.
+ * It is the sort hook too, @a arg is the timer of the coroutine.
+ */
+static bool
+work_yield_if_expired(void *arg)
+{
+    if (!coro_is_expired())
+        return false;
+    work_yield(arg);
+    return true;
+}
+
+static void
+work_timer_print(struct work_timer *t, int id)
+{
+    if (!t->is_on)
+        return;
+    work_timer_stop(t);
+    printf("Coroutine %d works %llu microsecond\n", id, t->total);
+}
+
+static void
+my_context_load(struct my_context *ctx)
+{
+    struct int_array numbers;
+    int_array_create(&numbers);
+    if (intfile_read(ctx->filename, &numbers) != 0) {
+        perror(ctx->filename);
+        exit(1);
+    }
+    ctx->arr = numbers.data;
+    ctx->size = (int)numbers.size;
+}
+
+/**
+ * Parse the numbers right from the mapped file, chunk by chunk.
+ * Other coroutines keep sorting while the file is loaded.
+ */
+static void
+my_context_load_mmap(struct my_context *ctx, struct work_timer *timer)
+{
+    struct intfile_map map;
+    if (intfile_map_open(ctx->filename, &map) != 0) {
+        perror(ctx->filename);
+        exit(1);
+    }
+    struct int_array numbers;
+    int_array_create(&numbers);
+    if (ctx->capacity > 0) {
+        /* The parser must not grow a preset array. */
+        if (map.size / 2 + 1 > ctx->capacity) {
+            fprintf(stderr, "%s has grown while sorted\n", ctx->filename);
+            exit(1);
+        }
+        numbers.data = ctx->arr;
+        numbers.capacity = ctx->capacity;
+    }
+    struct int_parser parser;
+    int_parser_create(&parser);
+    for (size_t pos = 0; pos < map.size; pos += LOAD_CHUNK) {
+        size_t len = map.size - pos;
+        if (len > LOAD_CHUNK)
+            len = LOAD_CHUNK;
+        int_parser_feed(&parser, map.data + pos, len, &numbers);
+        work_yield_if_expired(timer);
+    }
+    int_parser_finish(&parser, &numbers);
+    intfile_map_close(&map);
+    ctx->arr = numbers.data;
+    ctx->size = (int)numbers.size;
+}
+
+/** In the mmap mode the file is loaded later, by its coroutine. */
 static struct my_context *
-my_context_new(const char *filename)
+my_context_new(const char *filename, bool use_mmap)
 {
     struct my_context *ctx = malloc(sizeof(*ctx));
     ctx->filename = strdup(filename);
     ctx->size = 0;
     ctx->arr = NULL;
-    ctx->sorted = false;
-
-
-    FILE *f = fopen(filename, "r");
-
-    for(int next; fscanf(f, "%d", &next) != EOF; )
-        ctx->size++;
-    ctx->arr = (int *) malloc(sizeof (int) * ctx->size);
-
-    fseek(f, SEEK_SET, 0);
-    for(int _i = 0, next; fscanf(f, "%d", &next) != EOF; _i ++)
-        ctx->arr[_i] = next;
-    fclose(f);
+    ctx->capacity = 0;
+    struct stat st;
+    if (stat(filename, &st) != 0) {
+        perror(filename);
+        exit(1);
+    }
+    ctx->bytes = st.st_size;
 
+    if (!use_mmap)
+        my_context_load(ctx);
     return ctx;
 }
 
-static struct  works * works_new(int size, int lat){
+static struct  works * works_new(int size, int lat, bool use_mmap, sort_f sort,
+                                 bool is_profiling){
     struct works * result = malloc(sizeof (*result));
     result->files = (struct my_context **)malloc(sizeof (struct my_context *)*size);
     result->sz = size;
     result->lat = (ull)lat;
+    result->use_mmap = use_mmap;
+    result->sort = sort;
+    result->is_profiling = is_profiling;
+    result->items = NULL;
+    result->item_count = 0;
+    result->next_item = 0;
     return result;
 }
 
+/*
+ * Biggest weight first. There are only as many items as the files
+ * and their parts, so an insertion sort is enough. It is stable, so
+ * the parts of a file stay in order.
+ */
+static void
+work_items_sort(struct work_item *items, int count)
+{
+    for (int i = 1; i < count; i++) {
+        struct work_item item = items[i];
+        int j = i;
+        for (; j > 0 && items[j - 1].weight < item.weight; j--)
+            items[j] = items[j - 1];
+        items[j] = item;
+    }
+}
+
+/*
+ * Fill the work queue, when the files are set. The biggest work
+ * goes first (LPT), so a big file at the end of the command line
+ * does not become the critical path. With split the loaded files
+ * bigger than a fair share of one coroutine are cut into parts.
+ * The parts are sorted separately, the final merge takes them as
+ * separate runs.
+ */
+static void
+works_plan(struct works *ctx, bool split, int num_cor)
+{
+    size_t total = 0;
+    for (int i = 0; i < ctx->sz; i++)
+        total += ctx->use_mmap ? ctx->files[i]->bytes : (size_t)ctx->files[i]->size;
+    size_t share = (total + num_cor - 1) / num_cor;
+    if (ctx->use_mmap || share < SPLIT_MIN)
+        split = false;
+
+    ctx->item_count = 0;
+    for (int i = 0; i < ctx->sz; i++) {
+        size_t size = ctx->files[i]->size;
+        ctx->item_count += split && size > share ? (size + share - 1) / share : 1;
+    }
+    ctx->items = malloc(sizeof (*ctx->items) * ctx->item_count);
+    struct work_item *item = ctx->items;
+    for (int i = 0; i < ctx->sz; i++) {
+        struct my_context *file = ctx->files[i];
+        if (ctx->use_mmap) {
+            *item++ = (struct work_item) {file, 0, -1, file->bytes};
+            continue;
+        }
+        int parts = split && (size_t)file->size > share ? (file->size + share - 1) / share : 1;
+        for (int j = 0; j < parts; j++) {
+            int begin = (long long)file->size * j / parts;
+            int end = (long long)file->size * (j + 1) / parts;
+            *item++ = (struct work_item) {file, begin, end, (size_t)(end - begin)};
+        }
+    }
+    work_items_sort(ctx->items, ctx->item_count);
+    ctx->next_item = 0;
+}
+
+static struct work_item *
+works_claim(struct works *ctx)
+{
+    if (ctx->next_item == ctx->item_count)
+        return NULL;
+    return &ctx->items[ctx->next_item++];
+}
+
 static void coro_data_delete(struct  coro_data *ctx){
     free(ctx);
 }
@@ -92,129 +328,365 @@ works_delete(struct works *ctx)
     for(int i = 0; i < ctx->sz; i++)
         my_context_delete(ctx->files[i]);
     free(ctx->files);
+    free(ctx->items);
     free(ctx);
 }
 
 
-static void assign(int *arr, int *p1, const int *cur, int *p2){
-    arr[*p1] = cur[*p2];
-    (*p1)++;
-    (*p2)++;
-}
+/* Sort of the input in runs of a bounded size for --mem-limit. */
+struct ext_works {
+    struct extsort_reader reader;
+    struct extsort_run *runs;
+    int run_count;
+    int run_capacity;
+    /* Numbers in one run, each coroutine has a run and a scratch. */
+    size_t run_size;
+    ull lat;
+    sort_f sort;
+    bool is_profiling;
+};
 
-static void merge(int *arr, int l, int r) {
-    int mid = (l+r)/2;
-    int pointer1 = l;
-    int pointer2 = mid+1, position = 0;
-    int *answer = (int *) malloc((r-l+1) * sizeof (int));
-    while(pointer1 <= mid || pointer2 <= r) {
-        if(pointer1 > mid){
-            assign(answer, &position, arr, &pointer2);
-            continue;
+struct ext_coro_data {
+    struct ext_works *data;
+    int coro_id;
+};
+
+static int
+coroutine_func_f(void *context)
+{
+    struct coro_data *coro_ctx = context;
+    struct works *ctx = coro_ctx->data;
+    int id = coro_ctx->coro_id;
+    printf("Coro %d started\n", id);
+
+    coro_set_quantum((long long)ctx->lat);
+    struct work_timer timer = {.total = 0, .is_on = !ctx->is_profiling};
+    work_timer_start(&timer);
+
+    struct work_item *item;
+    while ((item = works_claim(ctx)) != NULL) {
+        printf("%d: yield\n", coro_ctx->coro_id);
+        work_yield(&timer);
+
+        struct my_context *file = item->file;
+        if (ctx->use_mmap) {
+            my_context_load_mmap(file, &timer);
+            item->end = file->size;
         }
-        if(pointer2 > r){
-            assign(answer, &position, arr, &pointer1);
-            continue;
+        int size = item->end - item->begin;
+        /* One scratch buffer for the whole sort of the part. */
+        int *scratch = (int *) malloc(sizeof (int) * size);
+        ctx->sort(file->arr + item->begin, size, scratch, work_yield_if_expired, &timer);
+        free(scratch);
+
+        work_yield_if_expired(&timer);
+    }
+    work_timer_print(&timer, id);
+    coro_data_delete(coro_ctx);
+    return id;
+}
+
+static void
+ext_works_add_run(struct ext_works *ctx, struct extsort_run *run)
+{
+    if (ctx->run_count == ctx->run_capacity) {
+        ctx->run_capacity = ctx->run_capacity == 0 ? 16 : ctx->run_capacity * 2;
+        ctx->runs = realloc(ctx->runs, sizeof (*ctx->runs) * ctx->run_capacity);
+    }
+    ctx->runs[ctx->run_count++] = *run;
+}
+
+static int
+coroutine_ext_func_f(void *context)
+{
+    struct ext_coro_data *coro_ctx = context;
+    struct ext_works *ctx = coro_ctx->data;
+    int id = coro_ctx->coro_id;
+    printf("Coro %d started\n", id);
+
+    coro_set_quantum((long long)ctx->lat);
+    struct work_timer timer = {.total = 0, .is_on = !ctx->is_profiling};
+    work_timer_start(&timer);
+
+    struct int_array run;
+    run.data = (int *) malloc(sizeof (int) * ctx->run_size);
+    run.size = 0;
+    run.capacity = ctx->run_size;
+    int *scratch = (int *) malloc(sizeof (int) * ctx->run_size);
+    while (true) {
+        if (extsort_reader_fill(&ctx->reader, &run) != 0) {
+            perror("Can't read the input");
+            exit(1);
         }
-        if(arr[pointer1] < arr[pointer2]){
-            assign(answer, &position, arr, &pointer1);
-        } else {
-            assign(answer, &position, arr, &pointer2);
+        if (run.size == 0)
+            break;
+        ctx->sort(run.data, run.size, scratch, work_yield_if_expired, &timer);
+        struct extsort_run spilled;
+        if (extsort_run_spill(run.data, run.size, &spilled) != 0) {
+            perror("Can't spill a run");
+            exit(1);
         }
+        ext_works_add_run(ctx, &spilled);
+        work_yield_if_expired(&timer);
     }
-    for(int i = l; i <= r; i++){
-        arr[i] = answer[i-l];
+    free(scratch);
+    free(run.data);
+    free(coro_ctx);
+    work_timer_print(&timer, id);
+    return id;
+}
+
+static void
+wait_coroutines(bool is_profiling)
+{
+    struct coro *c;
+    while ((c = coro_sched_wait()) != NULL) {
+        struct coro_stats stats;
+        coro_stats(c, &stats);
+        printf("Finished %d\n", coro_status(c));
+        printf("%d: switch count %lld\n", coro_status(c), stats.switch_count);
+        if (is_profiling)
+            printf("Coroutine %d works %lld microsecond, waits %lld microsecond, longest slice %lld microsecond\n",
+                   coro_status(c), stats.cpu_time / 1000, stats.wait_time / 1000, stats.max_slice / 1000);
+        coro_delete(c);
     }
-    free(answer);
 }
 
-ull to_ms(struct timespec tm){
-    return (ull) tm.tv_sec*1000000+(ull)tm.tv_nsec/1000;
+/* 64M, 512K, 1G; 0 is an error. */
+static size_t
+parse_size(const char *str)
+{
+    char *end;
+    unsigned long long size = strtoull(str, &end, 10);
+    if (end == str)
+        return 0;
+    if (*end == 'K' || *end == 'k')
+        size <<= 10;
+    else if (*end == 'M' || *end == 'm')
+        size <<= 20;
+    else if (*end == 'G' || *end == 'g')
+        size <<= 30;
+    else if (*end != 0)
+        return 0;
+    if (*end != 0 && end[1] != 0)
+        return 0;
+    return (size_t)size;
 }
 
-void to_yield(struct coro_data *ctx){
-    struct timespec current;
-    clock_gettime(CLOCK_MONOTONIC, &current);
-    if(to_ms(current) - to_ms(ctx->start) > ctx->data->lat) {
-//        printf("%d: switch count %lld\n", ctx->coro_id, coro_switch_count(coro_this()));
-//        printf("%d: yield\n", ctx->coro_id);
-        ctx->total_time += (to_ms(current) - to_ms(ctx->start));
-        coro_yield();
-        clock_gettime(CLOCK_MONOTONIC, &ctx->start);
+static void
+sort_external(const char *const *files, int num_file, int latency, int num_cor,
+              size_t mem_limit, sort_f sort, bool use_binary, bool is_profiling)
+{
+    /* The sort of the runs and the merge, they do not overlap. */
+    size_t run_mem = mem_limit - EXTSORT_READ_CHUNK;
+    struct ext_works data;
+    extsort_reader_create(&data.reader, files, num_file);
+    data.runs = NULL;
+    data.run_count = 0;
+    data.run_capacity = 0;
+    data.run_size = run_mem / num_cor / (2 * sizeof (int));
+    data.lat = (ull)latency;
+    data.sort = sort;
+    data.is_profiling = is_profiling;
+
+    for (int i = 0; i < num_cor; ++i) {
+        struct ext_coro_data *coro_ctx = malloc(sizeof (*coro_ctx));
+        coro_ctx->data = &data;
+        coro_ctx->coro_id = i;
+        coro_new(coroutine_ext_func_f, coro_ctx);
+    }
+    wait_coroutines(is_profiling);
+    extsort_reader_destroy(&data.reader);
+    printf("Spilled %d runs of up to %zu numbers\n", data.run_count, data.run_size);
+
+    const char *path = use_binary ? "result.bin" : "result.txt";
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Can't write the result");
+        exit(1);
+    }
+    struct intfile_writer out;
+    intfile_writer_create(&out, fd, use_binary ? INTFILE_BINARY : INTFILE_TEXT);
+    if (extsort_merge(data.runs, data.run_count, mem_limit, &out) != 0 ||
+        intfile_writer_flush(&out) != 0 || close(fd) != 0) {
+        perror("Can't write the result");
+        exit(1);
     }
+    intfile_writer_destroy(&out);
+    free(data.runs);
 }
 
+/*
+ * Shared memory of the --procs workers: the sorted files, each
+ * one in its own slot, and their sizes. A file of N bytes has at
+ * most N / 2 + 1 numbers, that is the slot size. The untouched
+ * pages take no memory.
+ */
+struct procs_shared {
+    size_t *sizes;
+    int *numbers;
+    /* Slot i is numbers[offsets[i]..offsets[i + 1]). */
+    size_t *offsets;
+    void *mem;
+    size_t mem_size;
+};
 
 static void
-sorting(struct coro_data *ctx, int *arr, int l, int r) {
-    if(r==l){
-        return ;
-    }
-    int mid = (l+r) / 2;
-    sorting(ctx, arr, l, mid);
-    to_yield(ctx);
-    sorting(ctx, arr, mid+1, r);
-    to_yield(ctx);
-    merge(arr, l, r);
+procs_worker(char **files, int num_file, int proc, const int *owner, int latency, int num_cor,
+             sort_f sort, bool is_profiling, struct procs_shared *shared)
+{
+    int count = 0;
+    for (int i = 0; i < num_file; i++)
+        count += owner[i] == proc;
+    /* The mmap loader, the files are parsed right into the slots. */
+    struct works *data = works_new(count, latency, true, sort, is_profiling);
+    for (int i = 0, j = 0; i < num_file; i++) {
+        if (owner[i] != proc)
+            continue;
+        struct my_context *ctx = my_context_new(files[i], true);
+        ctx->arr = &shared->numbers[shared->offsets[i]];
+        ctx->capacity = shared->offsets[i + 1] - shared->offsets[i];
+        data->files[j++] = ctx;
+    }
+    works_plan(data, false, num_cor);
+    for (int i = 0; i < num_cor; ++i) {
+        coro_new(coroutine_func_f, coro_data_new(data, i));
+    }
+    wait_coroutines(is_profiling);
+    for (int i = 0, j = 0; i < num_file; i++) {
+        if (owner[i] != proc)
+            continue;
+        shared->sizes[i] = data->files[j]->size;
+        data->files[j++]->arr = NULL;
+    }
+    works_delete(data);
 }
 
-static int
-coroutine_func_f(void *context)
-{
-    struct coro_data *coro_ctx = context;
-    struct works *ctx = coro_ctx->data;
-    struct coro *this = coro_this();
-    printf("Coro %d started\n", coro_ctx->coro_id);
+struct file_weight {
+    int file;
+    size_t weight;
+};
 
-    coro_ctx->total_time = (ull)0;
-    clock_gettime(CLOCK_MONOTONIC, &coro_ctx->start);
+/* Biggest weight first, by insertion like the work items. */
+static void
+file_weights_sort(struct file_weight *order, int count)
+{
+    for (int i = 1; i < count; i++) {
+        struct file_weight w = order[i];
+        int j = i;
+        for (; j > 0 && order[j - 1].weight < w.weight; j--)
+            order[j] = order[j - 1];
+        order[j] = w;
+    }
+}
 
-    for(int i = 0; i < ctx->sz; i++){
-        if(ctx->files[i] == NULL || ctx->files[i]->sorted){
-            continue;
+/* LPT again: the biggest file goes to the least loaded worker. */
+static int *
+procs_assign(const size_t *offsets, int num_file, int procs)
+{
+    struct file_weight *order = malloc(sizeof (*order) * num_file);
+    for (int i = 0; i < num_file; i++)
+        order[i] = (struct file_weight) {i, offsets[i + 1] - offsets[i]};
+    file_weights_sort(order, num_file);
+    size_t *load = calloc(procs, sizeof (*load));
+    int *owner = malloc(sizeof (*owner) * num_file);
+    for (int i = 0; i < num_file; i++) {
+        int least = 0;
+        for (int p = 1; p < procs; p++) {
+            if (load[p] < load[least])
+                least = p;
         }
-        ctx->files[i]->sorted = true;
-
-        printf("%d: yield\n", coro_ctx->coro_id);
-        coro_yield();
-        clock_gettime(CLOCK_MONOTONIC, &coro_ctx->start);
-
-        sorting(coro_ctx, ctx->files[i]->arr, 0, ctx->files[i]->size);
+        owner[order[i].file] = least;
+        load[least] += order[i].weight;
+    }
+    free(load);
+    free(order);
+    return owner;
+}
 
-        to_yield(coro_ctx);
+/* The final merge of the sorted files into the result file. */
+static void
+write_result(const struct sort_run *runs, int num_file, int threads, bool use_binary)
+{
+    /* Raw int32 for the tools which do not need text. */
+    int rc;
+    if (use_binary)
+        rc = pmerge_write(runs, num_file, threads, "result.bin", INTFILE_BINARY);
+    else
+        rc = pmerge_write(runs, num_file, threads, "result.txt", INTFILE_TEXT);
+    if (rc != 0) {
+        perror("Can't write the result");
+        exit(1);
     }
-    struct timespec cur;
-    clock_gettime(CLOCK_MONOTONIC, &cur);
-    coro_ctx->total_time += to_ms(cur) - to_ms(coro_ctx->start);
-    printf("%d: switch count %lld\n", coro_ctx->coro_id, coro_switch_count(this));
-    printf("Coroutine %d works %llu microsecond\n", coro_ctx->coro_id, coro_ctx->total_time);
-    coro_data_delete(coro_ctx);
-    return 0;
 }
 
-static void combine(struct my_context * first, struct my_context *second) {
-    int size = first->size + second->size;
-    int * arr = (int *) malloc(sizeof (int)*size);
-    int position = 0;
-    int p1 = 0, p2 = 0;
-    while(p1 < first->size || p2 < second->size){
-        if(p1 == first->size){
-            assign(arr, &position, second->arr, &p2);
-            continue;
+static void
+sort_procs(char **files, int num_file, int latency, int num_cor, int procs,
+           int threads, sort_f sort, bool use_binary, bool is_profiling)
+{
+    struct procs_shared shared;
+    shared.offsets = malloc(sizeof (size_t) * (num_file + 1));
+    shared.offsets[0] = 0;
+    for (int i = 0; i < num_file; i++) {
+        struct stat st;
+        if (stat(files[i], &st) != 0) {
+            perror(files[i]);
+            exit(1);
         }
-        if(p2 == second->size){
-            assign(arr, &position, first->arr, &p1);
-            continue;
+        shared.offsets[i + 1] = shared.offsets[i] + st.st_size / 2 + 1;
+    }
+    shared.mem_size = sizeof (size_t) * num_file + sizeof (int) * shared.offsets[num_file];
+    shared.mem = mmap(NULL, shared.mem_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (shared.mem == MAP_FAILED) {
+        perror("Can't map the shared memory");
+        exit(1);
+    }
+    shared.sizes = shared.mem;
+    shared.numbers = (int *)(shared.sizes + num_file);
+
+    if (procs > num_file)
+        procs = num_file;
+    /* Or the workers print the buffered output once more. */
+    int *owner = procs_assign(shared.offsets, num_file, procs);
+    fflush(stdout);
+    pid_t *pids = malloc(sizeof (pid_t) * procs);
+    for (int i = 0; i < procs; i++) {
+        pids[i] = fork();
+        if (pids[i] < 0) {
+            perror("fork");
+            exit(1);
         }
-        if(first->arr[p1] < second->arr[p2]){
-            assign(arr, &position, first->arr, &p1);
-        } else {
-            assign(arr, &position, second->arr, &p2);
+        if (pids[i] == 0) {
+            procs_worker(files, num_file, i, owner, latency, num_cor, sort,
+                         is_profiling, &shared);
+            exit(0);
         }
     }
-    free(first->arr);
-    first->size = size;
-    first->arr = arr;
+    bool is_ok = true;
+    for (int i = 0; i < procs; i++) {
+        int status;
+        if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "Worker %d failed\n", i);
+            is_ok = false;
+        }
+    }
+    free(pids);
+    free(owner);
+    if (!is_ok)
+        exit(1);
+
+    /* Straight from the shared memory, no copies. */
+    struct sort_run *runs = malloc(sizeof (*runs) * num_file);
+    for (int i = 0; i < num_file; i++) {
+        runs[i].data = &shared.numbers[shared.offsets[i]];
+        runs[i].size = shared.sizes[i];
+    }
+    write_result(runs, num_file, threads, use_binary);
+    free(runs);
+    munmap(shared.mem, shared.mem_size);
+    free(shared.offsets);
 }
 
 int
@@ -223,8 +695,56 @@ main(int argc, char **argv)
     if(argc == 1) {
         exit(0);
     }
+    bool use_mmap = false;
+    bool use_binary = false;
+    size_t mem_limit = 0;
+    int procs = 0;
+    int threads = 1;
+    bool split = false;
+    bool is_profiling = false;
+    sort_f sort = sort_merge;
+    int first_arg = 1;
+    for (; first_arg < argc && strncmp(argv[first_arg], "--", 2) == 0; first_arg++) {
+        const char *opt = argv[first_arg];
+        if (strcmp(opt, "--mmap") == 0) {
+            use_mmap = true;
+        } else if (strcmp(opt, "--split") == 0) {
+            split = true;
+        } else if (strcmp(opt, "--binary") == 0) {
+            use_binary = true;
+        } else if (strncmp(opt, "--mem-limit=", 12) == 0) {
+            mem_limit = parse_size(opt + 12);
+            if (mem_limit == 0) {
+                fprintf(stderr, "Bad memory limit %s\n", opt + 12);
+                exit(1);
+            }
+        } else if (strncmp(opt, "--procs=", 8) == 0) {
+            if (sscanf(opt + 8, "%d", &procs) != 1 || procs < 1) {
+                fprintf(stderr, "--procs should be natural\n");
+                exit(1);
+            }
+        } else if (strncmp(opt, "--threads=", 10) == 0) {
+            if (sscanf(opt + 10, "%d", &threads) != 1 || threads < 1) {
+                fprintf(stderr, "--threads should be natural\n");
+                exit(1);
+            }
+        } else if (strncmp(opt, "--algo=", 7) == 0) {
+            sort = sort_by_name(opt + 7);
+            if (sort == NULL) {
+                fprintf(stderr, "Unknown sort %s, use merge, radix or hybrid\n", opt + 7);
+                exit(1);
+            }
+        } else if (strcmp(opt, "--profile") == 0) {
+            is_profiling = true;
+        } else {
+            fprintf(stderr, "Unknown option %s\n", opt);
+            exit(1);
+        }
+    }
+    argc -= first_arg - 1;
+    argv += first_arg - 1;
     if(argc < 4){
-        fprintf(stderr, "Usage: %s LATENCY COROUTINES FILE...", argv[0]);
+        fprintf(stderr, "Usage: %s [--mmap] [--binary] [--mem-limit=SIZE[K|M|G]] [--procs=N] [--threads=N] [--split] [--algo=merge|radix|hybrid] [--profile] LATENCY COROUTINES FILE...", argv[0]);
         exit(1);
     }
 
@@ -240,36 +760,67 @@ main(int argc, char **argv)
         exit(1);
     }
 
+    if (split && (use_mmap || mem_limit > 0 || procs > 0)) {
+        fprintf(stderr, "--split cuts the loaded files, it does not work with --mmap, --mem-limit or --procs\n");
+        exit(1);
+    }
+    if (mem_limit > 0 && procs > 0) {
+        fprintf(stderr, "--procs keeps the files in memory, it does not work with --mem-limit\n");
+        exit(1);
+    }
+    if (mem_limit > 0) {
+        if (use_mmap) {
+            fprintf(stderr, "--mmap loads whole files, it does not work with --mem-limit\n");
+            exit(1);
+        }
+        size_t min_mem = EXTSORT_READ_CHUNK + (size_t)num_cor * 2 * sizeof (int) * 1024;
+        if (min_mem < EXTSORT_MERGE_MIN_MEM)
+            min_mem = EXTSORT_MERGE_MIN_MEM;
+        if (mem_limit < min_mem) {
+            fprintf(stderr, "The memory limit should be at least %zu bytes\n", min_mem);
+            exit(1);
+        }
+    }
+
     coro_sched_init();
+    coro_sched_set_profiling(is_profiling);
     struct timespec start;
     clock_gettime(CLOCK_MONOTONIC, &start);
 
     int num_file = argc - 3;
-    struct works * data = works_new(num_file, latency);
+    if (mem_limit > 0 || procs > 0) {
+        if (mem_limit > 0)
+            sort_external((const char *const *)&argv[3], num_file, latency, num_cor,
+                          mem_limit, sort, use_binary, is_profiling);
+        else
+            sort_procs(&argv[3], num_file, latency, num_cor, procs, threads, sort,
+                       use_binary, is_profiling);
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("Total execution time: %llu microseconds\n",  to_ms(end)-to_ms(start));
+        return 0;
+    }
+    struct works * data = works_new(num_file, latency, use_mmap, sort, is_profiling);
 
     for(int i = 0; i < num_file; i++){
-        data->files[i] = my_context_new(argv[i+3]);
+        data->files[i] = my_context_new(argv[i+3], use_mmap);
     }
+    works_plan(data, split, num_cor);
 
     for (int i = 0; i < num_cor; ++i) {
         coro_new(coroutine_func_f, coro_data_new(data, i));
     }
-    struct coro *c;
-    while ((c = coro_sched_wait()) != NULL) {
-        printf("Finished %d\n", coro_status(c));
-        coro_delete(c);
-    }
-    for(int i = 1; i < num_file; i++){
-        combine(data->files[i], data->files[i-1]);
+    wait_coroutines(is_profiling);
+    /* All the files and their parts at once, in one pass. */
+    struct sort_run *runs = malloc(sizeof (*runs) * data->item_count);
+    for(int i = 0; i < data->item_count; i++){
+        struct work_item *item = &data->items[i];
+        runs[i].data = item->file->arr + item->begin;
+        runs[i].size = item->end - item->begin;
     }
-
-    FILE *result = fopen("result.txt", "w");
-    for(int  i = 0; i < data->files[num_file-1]->size; i++){
-        fprintf(result, "%d ", data->files[num_file-1]->arr[i]);
-    }
-
+    write_result(runs, data->item_count, threads, use_binary);
+    free(runs);
     works_delete(data);
-    fclose(result);
 
     struct timespec end;
     clock_gettime(CLOCK_MONOTONIC, &end);
@@ -0,0 +1,292 @@
+#include "sort.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	/** How many numbers to process between the yield hook calls. */
+	SORT_YIELD_STEP = 8192,
+	/** Runs shorter than that are sorted by insertion. */
+	SORT_INSERTION_RUN = 32,
+	SORT_RADIX_BITS = 8,
+	SORT_RADIX_SIZE = 1 << SORT_RADIX_BITS,
+	SORT_RADIX_PASSES = 32 / SORT_RADIX_BITS,
+};
+
+/** Call the hook, if enough work is done since the last call. */
+static inline void
+sort_yield_step(size_t *since_yield, size_t work, sort_yield_f yield,
+		void *yield_arg)
+{
+	*since_yield += work;
+	if (*since_yield >= SORT_YIELD_STEP && yield != NULL) {
+		*since_yield = 0;
+		yield(yield_arg);
+	}
+}
+
+/** Merge sorted src[l, mid) and src[mid, r) into dst[l, r). */
+static void
+sort_merge_runs(const int *src, int *dst, size_t l, size_t mid, size_t r)
+{
+	size_t i = l, j = mid, k = l;
+	while (i < mid && j < r) {
+		if (src[j] < src[i])
+			dst[k++] = src[j++];
+		else
+			dst[k++] = src[i++];
+	}
+	memcpy(&dst[k], &src[i], (mid - i) * sizeof(*dst));
+	k += mid - i;
+	memcpy(&dst[k], &src[j], (r - j) * sizeof(*dst));
+}
+
+void
+sort_merge(int *arr, size_t size, int *scratch, sort_yield_f yield,
+	   void *yield_arg)
+{
+	int *src = arr;
+	int *dst = scratch;
+	size_t since_yield = 0;
+	for (size_t width = 1; width < size; width *= 2) {
+		for (size_t l = 0; l < size; l += 2 * width) {
+			size_t mid = l + width < size ? l + width : size;
+			size_t r = mid + width < size ? mid + width : size;
+			sort_merge_runs(src, dst, l, mid, r);
+			sort_yield_step(&since_yield, r - l, yield, yield_arg);
+		}
+		int *tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+	if (src != arr)
+		memcpy(arr, src, size * sizeof(*arr));
+}
+
+void
+sort_radix(int *arr, size_t size, int *scratch, sort_yield_f yield,
+	   void *yield_arg)
+{
+	/*
+	 * Flip the sign bit, so the negative numbers go first in
+	 * the unsigned order.
+	 */
+	const unsigned flip = 1u << 31;
+	size_t counts[SORT_RADIX_PASSES][SORT_RADIX_SIZE];
+	memset(counts, 0, sizeof(counts));
+	size_t since_yield = 0;
+	for (size_t i = 0; i < size; ++i) {
+		unsigned key = (unsigned)arr[i] ^ flip;
+		for (int p = 0; p < SORT_RADIX_PASSES; ++p)
+			++counts[p][(key >> (p * SORT_RADIX_BITS)) &
+				    (SORT_RADIX_SIZE - 1)];
+		if ((i + 1) % SORT_YIELD_STEP == 0)
+			sort_yield_step(&since_yield, SORT_YIELD_STEP, yield,
+					yield_arg);
+	}
+	int *src = arr;
+	int *dst = scratch;
+	for (int p = 0; p < SORT_RADIX_PASSES; ++p) {
+		int shift = p * SORT_RADIX_BITS;
+		size_t *count = counts[p];
+		if (size == 0 ||
+		    count[(((unsigned)src[0] ^ flip) >> shift) &
+			  (SORT_RADIX_SIZE - 1)] == size)
+			continue;
+		size_t offset = 0;
+		for (int d = 0; d < SORT_RADIX_SIZE; ++d) {
+			size_t c = count[d];
+			count[d] = offset;
+			offset += c;
+		}
+		for (size_t i = 0; i < size; ++i) {
+			unsigned key = (unsigned)src[i] ^ flip;
+			dst[count[(key >> shift) & (SORT_RADIX_SIZE - 1)]++] =
+				src[i];
+			if ((i + 1) % SORT_YIELD_STEP == 0)
+				sort_yield_step(&since_yield, SORT_YIELD_STEP,
+						yield, yield_arg);
+		}
+		int *tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+	if (src != arr)
+		memcpy(arr, src, size * sizeof(*arr));
+}
+
+/**
+ * Same as sort_merge_runs(), but the choice is done by arithmetic,
+ * so the random data does not cost branch mispredictions.
+ */
+static void
+sort_merge_runs_branchless(const int *src, int *dst, size_t l, size_t mid,
+			   size_t r)
+{
+	size_t i = l, j = mid, k = l;
+	while (i < mid && j < r) {
+		int a = src[i];
+		int b = src[j];
+		bool is_right = b < a;
+		dst[k++] = is_right ? b : a;
+		j += is_right;
+		i += !is_right;
+	}
+	memcpy(&dst[k], &src[i], (mid - i) * sizeof(*dst));
+	k += mid - i;
+	memcpy(&dst[k], &src[j], (r - j) * sizeof(*dst));
+}
+
+static void
+sort_insertion(int *arr, size_t size)
+{
+	for (size_t i = 1; i < size; ++i) {
+		int v = arr[i];
+		size_t j = i;
+		for (; j > 0 && arr[j - 1] > v; --j)
+			arr[j] = arr[j - 1];
+		arr[j] = v;
+	}
+}
+
+void
+sort_hybrid(int *arr, size_t size, int *scratch, sort_yield_f yield,
+	    void *yield_arg)
+{
+	size_t since_yield = 0;
+	for (size_t l = 0; l < size; l += SORT_INSERTION_RUN) {
+		size_t len = size - l < SORT_INSERTION_RUN ?
+			     size - l : SORT_INSERTION_RUN;
+		sort_insertion(&arr[l], len);
+		sort_yield_step(&since_yield, len, yield, yield_arg);
+	}
+	int *src = arr;
+	int *dst = scratch;
+	for (size_t width = SORT_INSERTION_RUN; width < size; width *= 2) {
+		for (size_t l = 0; l < size; l += 2 * width) {
+			size_t mid = l + width < size ? l + width : size;
+			size_t r = mid + width < size ? mid + width : size;
+			sort_merge_runs_branchless(src, dst, l, mid, r);
+			sort_yield_step(&since_yield, r - l, yield, yield_arg);
+		}
+		int *tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+	if (src != arr)
+		memcpy(arr, src, size * sizeof(*arr));
+}
+
+sort_f
+sort_by_name(const char *name)
+{
+	if (strcmp(name, "merge") == 0)
+		return sort_merge;
+	if (strcmp(name, "radix") == 0)
+		return sort_radix;
+	if (strcmp(name, "hybrid") == 0)
+		return sort_hybrid;
+	return NULL;
+}
+
+/** Unmerged rest of a run in the heap of sort_merge_k(). */
+struct sort_heap_node {
+	const int *pos;
+	const int *end;
+};
+
+static void
+sort_heap_sift_down(struct sort_heap_node *heap, int size, int i)
+{
+	struct sort_heap_node node = heap[i];
+	while (true) {
+		int child = 2 * i + 1;
+		if (child >= size)
+			break;
+		if (child + 1 < size && *heap[child + 1].pos < *heap[child].pos)
+			++child;
+		if (*node.pos <= *heap[child].pos)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = node;
+}
+
+void
+sort_merge_k(const struct sort_run *runs, int count, int *out)
+{
+	struct sort_heap_node *heap = malloc(sizeof(*heap) * (count + 1));
+	if (heap == NULL)
+		abort();
+	int size = 0;
+	for (int i = 0; i < count; ++i) {
+		if (runs[i].size == 0)
+			continue;
+		heap[size].pos = runs[i].data;
+		heap[size].end = runs[i].data + runs[i].size;
+		++size;
+	}
+	for (int i = size / 2 - 1; i >= 0; --i)
+		sort_heap_sift_down(heap, size, i);
+	while (size > 1) {
+		struct sort_heap_node *top = &heap[0];
+		*out++ = *top->pos++;
+		if (top->pos == top->end)
+			heap[0] = heap[--size];
+		sort_heap_sift_down(heap, size, 0);
+	}
+	/* The last run needs no comparisons. */
+	if (size == 1) {
+		size_t rest = heap[0].end - heap[0].pos;
+		memcpy(out, heap[0].pos, rest * sizeof(*out));
+	}
+	free(heap);
+}
+
+/** How many numbers of the run are < @a value, or <= if @a is_le. */
+static size_t
+sort_run_rank(const struct sort_run *run, long long value, bool is_le)
+{
+	size_t lo = 0, hi = run->size;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (run->data[mid] < value || (is_le && run->data[mid] == value))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+void
+sort_merge_k_split(const struct sort_run *runs, int count, size_t rank,
+		   size_t *splits)
+{
+	/* The least value, which has at least rank numbers <= it. */
+	long long lo = INT_MIN, hi = INT_MAX;
+	while (lo < hi) {
+		long long mid = lo + (hi - lo) / 2;
+		size_t le = 0;
+		for (int i = 0; i < count; ++i)
+			le += sort_run_rank(&runs[i], mid, true);
+		if (le >= rank)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	/* All the smaller numbers, then the equal ones up to rank. */
+	size_t taken = 0;
+	for (int i = 0; i < count; ++i) {
+		splits[i] = sort_run_rank(&runs[i], lo, false);
+		taken += splits[i];
+	}
+	for (int i = 0; i < count && taken < rank; ++i) {
+		size_t equal = sort_run_rank(&runs[i], lo, true) - splits[i];
+		if (equal > rank - taken)
+			equal = rank - taken;
+		splits[i] += equal;
+		taken += equal;
+	}
+}
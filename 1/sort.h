@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Sorting of the integer arrays for the coroutine merge sort. The
+ * sorts can be long, so they call a yield hook from time to time,
+ * like coro_yield_if_expired(). The hook can be NULL. It gets the
+ * caller's @a yield_arg, so it can reach the state of the caller,
+ * like a timer of the coroutine.
+ */
+typedef bool (*sort_yield_f)(void *arg);
+
+/**
+ * A sort engine. @a scratch should have room for @a size numbers,
+ * nothing else is allocated.
+ */
+typedef void (*sort_f)(int *arr, size_t size, int *scratch,
+		       sort_yield_f yield, void *yield_arg);
+
+/**
+ * Bottom-up merge sort. The runs are merged back and forth between
+ * @a arr and @a scratch, which should have room for @a size
+ * numbers. Nothing is allocated.
+ */
+void
+sort_merge(int *arr, size_t size, int *scratch, sort_yield_f yield,
+	   void *yield_arg);
+
+/**
+ * LSD radix sort by bytes. The passes, where all the numbers have
+ * the same byte, are skipped - small ranges take less passes.
+ */
+void
+sort_radix(int *arr, size_t size, int *scratch, sort_yield_f yield,
+	   void *yield_arg);
+
+/**
+ * Insertion sort of short runs, then the bottom-up merge of them
+ * without the branches on the comparisons.
+ */
+void
+sort_hybrid(int *arr, size_t size, int *scratch, sort_yield_f yield,
+	    void *yield_arg);
+
+/** Find a sort engine by name: merge, radix or hybrid. */
+sort_f
+sort_by_name(const char *name);
+
+/** A sorted array, an input of the K-way merge. */
+struct sort_run {
+	const int *data;
+	size_t size;
+};
+
+/**
+ * Merge @a count sorted runs into @a out, which should have room
+ * for all of them. A min-heap of the runs' heads is used, so it
+ * is O(total * log(count)).
+ */
+void
+sort_merge_k(const struct sort_run *runs, int count, int *out);
+
+/**
+ * Co-rank of the K-way merge: find the split of each run, so that
+ * the heads of all the runs are exactly the @a rank smallest
+ * numbers. The merges of the parts between two such splits are
+ * independent, so the output can be merged in parallel. The
+ * split value is found by a binary search, O(32 * count * log).
+ * @param[out] splits The head sizes, one per run.
+ */
+void
+sort_merge_k_split(const struct sort_run *runs, int count, size_t rank,
+		   size_t *splits);
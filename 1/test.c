@@ -0,0 +1,1326 @@
+#define _GNU_SOURCE
+#include "libcoro.h"
+#include "intfile.h"
+#include "extsort.h"
+#include "pmerge.h"
+#include "sort.h"
+#include "unit.h"
+
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/** Tests of the coroutine library itself, without sorting. */
+
+static int
+coro_ret_arg_f(void *arg)
+{
+	return *(int *)arg;
+}
+
+static void
+test_basic(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	unit_check(coro_sched_wait() == NULL, "no coroutines - no wait");
+
+	int arg = 123;
+	struct coro *c = coro_new(coro_ret_arg_f, &arg);
+	unit_check(!coro_is_finished(c), "not started yet");
+	unit_check(coro_sched_wait() == c, "wait returns the coroutine");
+	unit_check(coro_is_finished(c), "finished");
+	unit_check(coro_status(c) == 123, "status is the func result");
+	coro_delete(c);
+	unit_check(coro_sched_wait() == NULL, "no more coroutines");
+
+	unit_test_finish();
+}
+
+struct yield_arg {
+	int id;
+	int count;
+	int *log;
+	int *log_size;
+};
+
+static int
+coro_yield_f(void *arg)
+{
+	struct yield_arg *a = arg;
+	for (int i = 0; i < a->count; ++i) {
+		a->log[(*a->log_size)++] = a->id;
+		coro_yield();
+	}
+	return a->id;
+}
+
+static void
+test_yield(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	enum { CORO_COUNT = 3, YIELD_COUNT = 5 };
+	int log[CORO_COUNT * YIELD_COUNT];
+	int log_size = 0;
+	struct yield_arg args[CORO_COUNT];
+	for (int i = 0; i < CORO_COUNT; ++i) {
+		args[i] = (struct yield_arg) {i, YIELD_COUNT, log, &log_size};
+		coro_new(coro_yield_f, &args[i]);
+	}
+	int finished = 0;
+	int status_sum = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		++finished;
+		status_sum += coro_status(c);
+		unit_fail_if(coro_switch_count(c) < YIELD_COUNT);
+		coro_delete(c);
+	}
+	unit_check(finished == CORO_COUNT, "all finished");
+	unit_check(status_sum == 0 + 1 + 2, "all statuses are returned");
+	unit_check(log_size == CORO_COUNT * YIELD_COUNT, "all steps are done");
+	bool is_interleaved = true;
+	for (int i = 1; i < log_size; ++i) {
+		if (log[i] == log[i - 1])
+			is_interleaved = false;
+	}
+	unit_check(is_interleaved, "coroutines interleave on yield");
+
+	unit_test_finish();
+}
+
+static int
+coro_recursive_f(void *arg)
+{
+	int depth = *(int *)arg;
+	if (depth == 0)
+		return 0;
+	volatile char buf[512];
+	buf[0] = (char)depth;
+	int next = depth - 1;
+	coro_yield();
+	return coro_recursive_f(&next) + buf[0] - depth + 1;
+}
+
+static void
+test_stack(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	int depth = 100;
+	struct coro *c1 = coro_new(coro_recursive_f, &depth);
+	struct coro *c2 = coro_new(coro_recursive_f, &depth);
+	struct coro *c;
+	int sum = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		sum += coro_status(c);
+		unit_fail_if(c != c1 && c != c2);
+		coro_delete(c);
+	}
+	unit_check(sum == 2 * depth, "stacks are not mixed up");
+
+	unit_test_finish();
+}
+
+static void
+test_stack_pool(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	coro_stack_pool_configure(1, false, true);
+	struct coro_stack_pool_stats stats;
+	coro_stack_pool_stats(&stats);
+	long long misses = stats.misses;
+	long long hits = stats.hits;
+	int arg = 0;
+	for (int i = 0; i < 3; ++i) {
+		coro_new(coro_ret_arg_f, &arg);
+		coro_delete(coro_sched_wait());
+	}
+	coro_stack_pool_stats(&stats);
+	unit_check(stats.hits - hits >= 2, "stacks are reused");
+	unit_check(stats.misses - misses <= 1, "at most one stack is mapped");
+	unit_check(stats.cached == 1, "one stack is cached");
+
+	coro_new(coro_ret_arg_f, &arg);
+	coro_new(coro_ret_arg_f, &arg);
+	coro_delete(coro_sched_wait());
+	coro_delete(coro_sched_wait());
+	coro_stack_pool_stats(&stats);
+	unit_check(stats.cached == 1, "extra stacks are unmapped");
+
+	coro_stack_pool_configure(0, true, true);
+	coro_stack_pool_stats(&stats);
+	unit_check(stats.cached == 0, "pool is trimmed");
+
+	unit_test_finish();
+}
+
+static void
+test_attr(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	struct coro_attr attr;
+	coro_attr_init(&attr);
+	attr.stack_size = 16 * 1024;
+	attr.name = "a name which is too long to fit into a coroutine";
+	attr.priority = CORO_PRIO_MAX + 10;
+	attr.stack_probe = true;
+	int depth = 10;
+	struct coro *c = coro_new_ex(coro_recursive_f, &depth, &attr);
+	unit_check(strncmp(coro_name(c), attr.name, CORO_NAME_MAX - 1) == 0 &&
+		   strlen(coro_name(c)) == CORO_NAME_MAX - 1,
+		   "name is truncated");
+	unit_check(coro_priority(c) == CORO_PRIO_MAX, "priority is clamped");
+	unit_check(coro_sched_wait() == c, "small stack is enough");
+	long long usage = coro_stack_usage(c);
+	unit_check(usage >= depth * 512, "stack usage covers the recursion");
+	unit_check(usage < 16 * 1024, "stack usage fits the size");
+	coro_delete(c);
+
+	c = coro_new(coro_ret_arg_f, &depth);
+	unit_check(coro_name(c)[0] == 0, "no name by default");
+	unit_check(coro_priority(c) == CORO_PRIO_DEFAULT, "default priority");
+	unit_check(coro_stack_usage(c) == -1, "no stack probe by default");
+	coro_delete(coro_sched_wait());
+
+	unit_test_finish();
+}
+
+static int
+coro_suspend_f(void *arg)
+{
+	int *counter = arg;
+	++*counter;
+	coro_suspend();
+	++*counter;
+	return 0;
+}
+
+static int
+coro_wakeup_f(void *arg)
+{
+	struct coro *sleeper = arg;
+	for (int i = 0; i < 10; ++i)
+		coro_yield();
+	coro_wakeup(sleeper);
+	return 0;
+}
+
+static void
+test_suspend(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	int counter = 0;
+	struct coro *c1 = coro_new(coro_suspend_f, &counter);
+	struct coro *c2 = coro_new(coro_wakeup_f, c1);
+	unit_check(coro_sched_wait() == c2, "waker finishes first");
+	unit_check(counter == 1, "sleeper is suspended");
+	unit_check(coro_switch_count(c1) == 1, "suspended one is not "
+		   "scheduled");
+	unit_check(coro_sched_wait() == c1, "sleeper is woken up");
+	unit_check(counter == 2, "and finished");
+	coro_delete(c1);
+	coro_delete(c2);
+
+	unit_test_finish();
+}
+
+struct sleep_arg {
+	double timeout;
+	int *log;
+	int *log_size;
+	int id;
+};
+
+static int
+coro_sleep_f(void *arg)
+{
+	struct sleep_arg *a = arg;
+	coro_sleep(a->timeout);
+	a->log[(*a->log_size)++] = a->id;
+	return 0;
+}
+
+static void
+test_sleep(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	int log[3];
+	int log_size = 0;
+	struct sleep_arg args[3] = {
+		{0.03, log, &log_size, 0},
+		{0.01, log, &log_size, 1},
+		{0.02, log, &log_size, 2},
+	};
+	for (int i = 0; i < 3; ++i)
+		coro_new(coro_sleep_f, &args[i]);
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double duration = end.tv_sec - start.tv_sec +
+			  (end.tv_nsec - start.tv_nsec) / 1e9;
+	unit_check(log_size == 3, "all woke up");
+	unit_check(log[0] == 1 && log[1] == 2 && log[2] == 0,
+		   "in the order of timeouts");
+	unit_check(duration >= 0.03 && duration < 0.5,
+		   "sleeps are concurrent");
+
+	int counter = 0;
+	struct sleep_arg arg = {100, log, &log_size, 0};
+	c = coro_new(coro_sleep_f, &arg);
+	coro_new(coro_wakeup_f, c);
+	while ((c = coro_sched_wait()) != NULL) {
+		++counter;
+		coro_delete(c);
+	}
+	unit_check(counter == 2, "wakeup interrupts a sleep");
+
+	unit_test_finish();
+}
+
+static void
+test_priority(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	enum { YIELD_COUNT = 3 };
+	int log[2 * YIELD_COUNT];
+	int log_size = 0;
+	struct yield_arg low = {0, YIELD_COUNT, log, &log_size};
+	struct yield_arg high = {1, YIELD_COUNT, log, &log_size};
+	struct coro_attr attr;
+	coro_attr_init(&attr);
+	attr.priority = CORO_PRIO_MIN;
+	coro_new_ex(coro_yield_f, &low, &attr);
+	attr.priority = CORO_PRIO_MAX;
+	coro_new_ex(coro_yield_f, &high, &attr);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	bool is_ordered = true;
+	for (int i = 0; i < 2 * YIELD_COUNT; ++i)
+		is_ordered = is_ordered && log[i] == (i < YIELD_COUNT);
+	unit_check(is_ordered, "high priority runs first");
+
+	unit_test_finish();
+}
+
+static long long
+thread_cpu_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+enum { PROF_SLICE_NS = 2000000, PROF_SLICES = 3 };
+
+static int
+coro_hog_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < PROF_SLICES; ++i) {
+		long long end = thread_cpu_ns() + PROF_SLICE_NS;
+		while (thread_cpu_ns() < end)
+			;
+		coro_yield();
+	}
+	return 0;
+}
+
+static int
+coro_dump_f(void *arg)
+{
+	char **text = arg;
+	size_t size;
+	FILE *out = open_memstream(text, &size);
+	coro_sched_dump(out);
+	fclose(out);
+	for (int i = 0; i < PROF_SLICES; ++i)
+		coro_yield();
+	return 0;
+}
+
+static void
+test_profile(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	coro_sched_set_profiling(true);
+	char *dump = NULL;
+	struct coro_attr attr;
+	coro_attr_init(&attr);
+	attr.name = "hog";
+	struct coro *hog = coro_new_ex(coro_hog_f, NULL, &attr);
+	attr.name = "light";
+	struct coro *light = coro_new_ex(coro_dump_f, &dump, &attr);
+	struct coro_stats hog_stats, light_stats;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		if (c == hog)
+			coro_stats(c, &hog_stats);
+		else if (c == light)
+			coro_stats(c, &light_stats);
+		coro_delete(c);
+	}
+	coro_sched_set_profiling(false);
+	unit_check(hog_stats.cpu_time >= PROF_SLICES * PROF_SLICE_NS,
+		   "CPU time is counted");
+	unit_check(hog_stats.max_slice >= PROF_SLICE_NS &&
+		   hog_stats.max_slice <= hog_stats.cpu_time, "longest slice");
+	unit_check(hog_stats.switch_count > 0, "switch count");
+	unit_check(light_stats.cpu_time < hog_stats.cpu_time,
+		   "light one is light");
+	unit_check(light_stats.wait_time >= PROF_SLICES * PROF_SLICE_NS,
+		   "light one waits for the hog");
+	unit_check(strstr(dump, "hog") != NULL && strstr(dump, "light") != NULL &&
+		   strstr(dump, "running") != NULL, "dump");
+	free(dump);
+
+	unit_test_finish();
+}
+
+struct quantum_arg {
+	long long quantum;
+	int yield_count;
+	bool is_expired;
+	bool *is_done;
+};
+
+static int
+coro_quantum_f(void *arg)
+{
+	struct quantum_arg *a = arg;
+	coro_set_quantum(a->quantum);
+	a->is_expired = coro_is_expired();
+	long long end = thread_cpu_ns() + 10 * PROF_SLICE_NS;
+	while (thread_cpu_ns() < end)
+		a->yield_count += coro_yield_if_expired();
+	*a->is_done = true;
+	return 0;
+}
+
+static int
+coro_peer_f(void *arg)
+{
+	bool *is_done = arg;
+	int count = 0;
+	while (!*is_done) {
+		++count;
+		coro_yield();
+	}
+	return count;
+}
+
+static void
+test_quantum(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	bool is_done = false;
+	struct quantum_arg a = {PROF_SLICE_NS / 1000, 0, false, &is_done};
+	coro_new(coro_quantum_f, &a);
+	coro_new(coro_peer_f, &is_done);
+	struct coro *c;
+	int peer_turns = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		peer_turns += coro_status(c);
+		coro_delete(c);
+	}
+	/* The slices are wall time, the loop runs on CPU time. */
+	unit_check(a.yield_count >= 5 && a.yield_count <= 100,
+		   "yields once per quantum");
+	unit_check(peer_turns >= a.yield_count, "others get the CPU");
+	unit_check(!a.is_expired, "a new slice is not expired");
+
+	is_done = false;
+	a.quantum = -1;
+	a.yield_count = 0;
+	coro_new(coro_quantum_f, &a);
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	unit_check(a.yield_count == 0, "no quantum - no yields");
+
+	unit_test_finish();
+}
+
+struct mt_arg {
+	int id;
+	long long sum;
+	struct coro *peer;
+	int *ready_count;
+};
+
+static int
+coro_mt_f(void *arg)
+{
+	struct mt_arg *a = arg;
+	for (int i = 0; i < 100; ++i) {
+		a->sum += i;
+		coro_yield();
+	}
+	coro_sleep(0.001);
+	return a->id;
+}
+
+static int
+coro_mt_suspend_f(void *arg)
+{
+	struct mt_arg *a = arg;
+	__atomic_add_fetch(a->ready_count, 1, __ATOMIC_RELEASE);
+	coro_suspend();
+	return a->id;
+}
+
+static int
+coro_mt_wakeup_f(void *arg)
+{
+	struct mt_arg *a = arg;
+	/* Wake the peer only when it is surely suspended. */
+	while (__atomic_load_n(a->ready_count, __ATOMIC_ACQUIRE) == 0)
+		coro_yield();
+	coro_sleep(0.001);
+	coro_wakeup(a->peer);
+	return a->id;
+}
+
+static void
+test_mt(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	unit_check(coro_sched_start_workers(0) != 0, "0 workers is an error");
+	unit_check(coro_sched_start_workers(4) == 0, "start workers");
+	enum { CORO_COUNT = 100 };
+	struct mt_arg args[CORO_COUNT];
+	int id_sum = 0;
+	for (int i = 0; i < CORO_COUNT; ++i) {
+		args[i] = (struct mt_arg) {i, 0, NULL, NULL};
+		id_sum += i;
+		coro_new(coro_mt_f, &args[i]);
+	}
+	struct coro *c;
+	int status_sum = 0;
+	int count = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		status_sum += coro_status(c);
+		++count;
+		coro_delete(c);
+	}
+	unit_check(count == CORO_COUNT, "all are finished");
+	unit_check(status_sum == id_sum, "all statuses are returned");
+	bool is_ok = true;
+	for (int i = 0; i < CORO_COUNT; ++i)
+		is_ok = is_ok && args[i].sum == 99 * 100 / 2;
+	unit_check(is_ok, "all did their work");
+
+	int ready_counts[CORO_COUNT / 2] = {0};
+	for (int i = 0; i < CORO_COUNT; i += 2) {
+		int *ready_count = &ready_counts[i / 2];
+		args[i] = (struct mt_arg) {i, 0, NULL, ready_count};
+		args[i + 1] = (struct mt_arg) {i + 1, 0, NULL, ready_count};
+		args[i + 1].peer = coro_new(coro_mt_suspend_f, &args[i]);
+		coro_new(coro_mt_wakeup_f, &args[i + 1]);
+	}
+	count = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		++count;
+		coro_delete(c);
+	}
+	unit_check(count == CORO_COUNT, "suspended ones are woken up");
+	coro_sched_stop_workers();
+
+	unit_test_finish();
+}
+
+struct io_arg {
+	int fd;
+	int step;
+	int *log;
+	int *log_size;
+};
+
+static int
+coro_reader_f(void *arg)
+{
+	struct io_arg *a = arg;
+	char buf[16];
+	a->log[(*a->log_size)++] = 0;
+	ssize_t rc = coro_read(a->fd, buf, sizeof(buf));
+	a->log[(*a->log_size)++] = 0;
+	return rc == 5 && memcmp(buf, "hello", 5) == 0 ? 0 : -1;
+}
+
+static int
+coro_writer_f(void *arg)
+{
+	struct io_arg *a = arg;
+	for (int i = 0; i < 3; ++i) {
+		a->log[(*a->log_size)++] = 1;
+		coro_yield();
+	}
+	return coro_write(a->fd, "hello", 5) == 5 ? 0 : -1;
+}
+
+static void
+test_io_pipe(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	int fds[2];
+	unit_fail_if(pipe2(fds, O_NONBLOCK) != 0);
+	int log[8];
+	int log_size = 0;
+	struct io_arg rarg = {fds[0], 0, log, &log_size};
+	struct io_arg warg = {fds[1], 0, log, &log_size};
+	struct coro *r = coro_new(coro_reader_f, &rarg);
+	coro_new(coro_writer_f, &warg);
+	struct coro *c;
+	int status = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		status |= coro_status(c);
+		if (c == r) {
+			unit_check(coro_switch_count(c) == 1,
+				   "reader is not scheduled while waits");
+		}
+		coro_delete(c);
+	}
+	unit_check(status == 0, "data is transferred");
+	unit_check(log_size == 5 && log[0] == 0 && log[4] == 0,
+		   "writer works while reader waits");
+	close(fds[0]);
+	close(fds[1]);
+
+	unit_test_finish();
+}
+
+static int
+coro_byte_reader_f(void *arg)
+{
+	struct io_arg *a = arg;
+	char c;
+	return coro_read(a->fd, &c, 1) == 1 && c == 'x' ? 0 : -1;
+}
+
+static int
+coro_bytes_writer_f(void *arg)
+{
+	struct io_arg *a = arg;
+	/* Let all the readers wait on the same fd. */
+	for (int i = 0; i < 3; ++i)
+		coro_yield();
+	return coro_write(a->fd, "xxx", 3) == 3 ? 0 : -1;
+}
+
+static void
+test_io_shared_fd(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	int fds[2];
+	unit_fail_if(pipe2(fds, O_NONBLOCK) != 0);
+	enum { READER_COUNT = 3 };
+	struct io_arg arg = {fds[0], 0, NULL, NULL};
+	for (int i = 0; i < READER_COUNT; ++i)
+		coro_new(coro_byte_reader_f, &arg);
+	struct io_arg warg = {fds[1], 0, NULL, NULL};
+	coro_new(coro_bytes_writer_f, &warg);
+	struct coro *c;
+	int status = 0;
+	int count = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		status |= coro_status(c);
+		++count;
+		coro_delete(c);
+	}
+	unit_check(count == READER_COUNT + 1, "all finished");
+	unit_check(status == 0, "each waiter got its byte");
+	close(fds[0]);
+	close(fds[1]);
+
+	unit_test_finish();
+}
+
+static int
+coro_server_f(void *arg)
+{
+	struct io_arg *a = arg;
+	int fd = coro_accept(a->fd, NULL, NULL);
+	if (fd < 0)
+		return -1;
+	char buf[16];
+	ssize_t rc = coro_read(fd, buf, sizeof(buf));
+	if (rc > 0)
+		rc = coro_write(fd, buf, rc);
+	close(fd);
+	return rc == 4 ? 0 : -1;
+}
+
+static int
+coro_client_f(void *arg)
+{
+	struct io_arg *a = arg;
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	getsockname(a->fd, (struct sockaddr *)&addr, &len);
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	int rc = coro_connect(fd, (struct sockaddr *)&addr, len);
+	char buf[16];
+	if (rc == 0 && coro_write(fd, "ping", 4) == 4 &&
+	    coro_read(fd, buf, sizeof(buf)) == 4 &&
+	    memcmp(buf, "ping", 4) == 0)
+		rc = 0;
+	else
+		rc = -1;
+	close(fd);
+	return rc;
+}
+
+static void
+test_io_socket(bool is_mt)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	if (is_mt)
+		unit_fail_if(coro_sched_start_workers(2) != 0);
+	int lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	unit_fail_if(bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0);
+	unit_fail_if(listen(lfd, 10) != 0);
+	enum { CLIENT_COUNT = 10 };
+	struct io_arg arg = {lfd, 0, NULL, NULL};
+	for (int i = 0; i < CLIENT_COUNT; ++i) {
+		coro_new(coro_server_f, &arg);
+		coro_new(coro_client_f, &arg);
+	}
+	struct coro *c;
+	int status = 0;
+	int count = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		status |= coro_status(c);
+		++count;
+		coro_delete(c);
+	}
+	unit_check(count == 2 * CLIENT_COUNT, "all finished");
+	unit_check(status == 0, "accept, connect, echo");
+	close(lfd);
+	if (is_mt)
+		coro_sched_stop_workers();
+
+	unit_test_finish();
+}
+
+struct sync_arg {
+	struct coro_mutex *mutex;
+	struct coro_cond *cond;
+	struct coro_channel *channel;
+	/** Shared state guarded by the mutex. */
+	long counter;
+	int in_section;
+	bool is_broken;
+	long sum;
+};
+
+enum { SYNC_ITERATIONS = 1000 };
+
+static int
+coro_mutex_f(void *arg)
+{
+	struct sync_arg *a = arg;
+	for (int i = 0; i < SYNC_ITERATIONS; ++i) {
+		coro_mutex_lock(a->mutex);
+		if (a->in_section++ != 0)
+			a->is_broken = true;
+		long v = a->counter;
+		/* Let the others try to get in. */
+		coro_yield();
+		a->counter = v + 1;
+		--a->in_section;
+		coro_mutex_unlock(a->mutex);
+	}
+	return 0;
+}
+
+static int
+coro_cond_consumer_f(void *arg)
+{
+	struct sync_arg *a = arg;
+	coro_mutex_lock(a->mutex);
+	while (a->counter == 0)
+		coro_cond_wait(a->cond, a->mutex);
+	--a->counter;
+	coro_mutex_unlock(a->mutex);
+	return 0;
+}
+
+static int
+coro_cond_producer_f(void *arg)
+{
+	struct sync_arg *a = arg;
+	coro_yield();
+	coro_mutex_lock(a->mutex);
+	a->counter = 1;
+	coro_cond_signal(a->cond);
+	coro_mutex_unlock(a->mutex);
+	coro_yield();
+	coro_mutex_lock(a->mutex);
+	a->counter += 3;
+	coro_cond_broadcast(a->cond);
+	coro_mutex_unlock(a->mutex);
+	return 0;
+}
+
+static int
+coro_channel_sender_f(void *arg)
+{
+	struct sync_arg *a = arg;
+	for (long i = 1; i <= SYNC_ITERATIONS; ++i) {
+		if (coro_channel_send(a->channel, (void *)i) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+coro_channel_receiver_f(void *arg)
+{
+	struct sync_arg *a = arg;
+	void *v;
+	long sum = 0;
+	while (coro_channel_recv(a->channel, &v) == 0)
+		sum += (long)v;
+	__atomic_add_fetch(&a->sum, sum, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int
+coro_channel_closer_f(void *arg)
+{
+	struct sync_arg *a = arg;
+	/* Wait for the senders. */
+	coro_mutex_lock(a->mutex);
+	while (a->counter != 0)
+		coro_cond_wait(a->cond, a->mutex);
+	coro_mutex_unlock(a->mutex);
+	coro_channel_close(a->channel);
+	return 0;
+}
+
+static int
+coro_channel_counted_sender_f(void *arg)
+{
+	struct sync_arg *a = arg;
+	int rc = coro_channel_sender_f(arg);
+	coro_mutex_lock(a->mutex);
+	if (--a->counter == 0)
+		coro_cond_signal(a->cond);
+	coro_mutex_unlock(a->mutex);
+	return rc;
+}
+
+/** Reap all the coroutines and count those which have succeeded. */
+static int
+sync_wait_all(void)
+{
+	struct coro *c;
+	int count = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		if (coro_status(c) == 0)
+			++count;
+		coro_delete(c);
+	}
+	return count;
+}
+
+static void
+test_sync(bool is_mt)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	if (is_mt)
+		unit_fail_if(coro_sched_start_workers(2) != 0);
+	struct sync_arg a;
+	memset(&a, 0, sizeof(a));
+	a.mutex = coro_mutex_new();
+	a.cond = coro_cond_new();
+
+	enum { CORO_COUNT = 8 };
+	for (int i = 0; i < CORO_COUNT; ++i)
+		coro_new(coro_mutex_f, &a);
+	unit_check(sync_wait_all() == CORO_COUNT, "mutex users finished");
+	unit_check(!a.is_broken, "mutual exclusion");
+	unit_check(a.counter == CORO_COUNT * SYNC_ITERATIONS, "no lost updates");
+	unit_check(coro_mutex_trylock(a.mutex), "trylock a free mutex");
+	unit_check(!coro_mutex_trylock(a.mutex), "trylock a locked mutex");
+	coro_mutex_unlock(a.mutex);
+
+	a.counter = 0;
+	for (int i = 0; i < 4; ++i)
+		coro_new(coro_cond_consumer_f, &a);
+	coro_new(coro_cond_producer_f, &a);
+	unit_check(sync_wait_all() == 5, "cond signal and broadcast");
+	unit_check(a.counter == 0, "each consumer got its item");
+
+	long expected = (long)SYNC_ITERATIONS * (SYNC_ITERATIONS + 1) / 2;
+	int capacities[] = {0, 1, 16};
+	for (int j = 0; j < 3; ++j) {
+		enum { SENDERS = 4, RECEIVERS = 3 };
+		a.channel = coro_channel_new(capacities[j]);
+		a.counter = SENDERS;
+		a.sum = 0;
+		for (int i = 0; i < RECEIVERS; ++i)
+			coro_new(coro_channel_receiver_f, &a);
+		for (int i = 0; i < SENDERS; ++i)
+			coro_new(coro_channel_counted_sender_f, &a);
+		coro_new(coro_channel_closer_f, &a);
+		unit_check(sync_wait_all() == SENDERS + RECEIVERS + 1,
+			   "channel users finished");
+		unit_check(a.sum == SENDERS * expected, "all messages received");
+		coro_channel_delete(a.channel);
+	}
+
+	a.channel = coro_channel_new(2);
+	unit_check(coro_channel_new(-1) == NULL, "negative capacity");
+	coro_new(coro_channel_sender_f, &a);
+	coro_new(coro_channel_closer_f, &a);
+	unit_check(sync_wait_all() == 1, "send to a closed channel fails");
+	void *v;
+	unit_check(coro_channel_recv(a.channel, &v) == 0 && (long)v == 1,
+		   "buffered message survives close");
+	unit_check(coro_channel_recv(a.channel, &v) == 0 && (long)v == 2,
+		   "buffered message survives close");
+	unit_check(coro_channel_recv(a.channel, &v) == -1,
+		   "closed and empty");
+	coro_channel_delete(a.channel);
+
+	coro_cond_delete(a.cond);
+	coro_mutex_delete(a.mutex);
+	if (is_mt)
+		coro_sched_stop_workers();
+
+	unit_test_finish();
+}
+
+static void
+test_intfile(void)
+{
+	unit_test_start();
+
+	const char *text = "12 -7\n2147483647  0\t-2147483648 5";
+	int expected[] = {12, -7, 2147483647, 0, -2147483648, 5};
+	size_t count = sizeof(expected) / sizeof(expected[0]);
+	struct int_array arr;
+	int_array_create(&arr);
+	struct int_parser p;
+	int_parser_create(&p);
+	int_parser_feed(&p, text, strlen(text), &arr);
+	int_parser_finish(&p, &arr);
+	unit_check(arr.size == count && memcmp(arr.data, expected,
+		   sizeof(expected)) == 0, "one chunk");
+
+	/* Each number split by the chunk borders in all the ways. */
+	arr.size = 0;
+	for (size_t i = 0; text[i] != 0; ++i)
+		int_parser_feed(&p, &text[i], 1, &arr);
+	int_parser_finish(&p, &arr);
+	unit_check(arr.size == count && memcmp(arr.data, expected,
+		   sizeof(expected)) == 0, "byte by byte");
+
+	/* Mapped files, fed in chunks like the --mmap loader does. */
+	enum { MAP_CHUNK = 64 * 1024 };
+	char map_path[] = "/tmp/test_intfile_XXXXXX";
+	int map_fd = mkstemp(map_path);
+	unit_fail_if(map_fd < 0);
+	struct intfile_map map;
+	unit_check(intfile_map_open(map_path, &map) == 0 && map.size == 0,
+		   "map an empty file");
+	intfile_map_close(&map);
+	/* A number across the chunk border, no newline in the end. */
+	char *text_big = malloc(MAP_CHUNK + 16);
+	memset(text_big, ' ', MAP_CHUNK - 3);
+	strcpy(text_big + MAP_CHUNK - 3, "-123456 78");
+	size_t text_big_len = strlen(text_big);
+	unit_fail_if(write(map_fd, text_big, text_big_len) !=
+		     (ssize_t)text_big_len);
+	close(map_fd);
+	free(text_big);
+	unit_fail_if(intfile_map_open(map_path, &map) != 0);
+	arr.size = 0;
+	for (size_t pos = 0; pos < map.size; pos += MAP_CHUNK) {
+		size_t len = map.size - pos;
+		if (len > MAP_CHUNK)
+			len = MAP_CHUNK;
+		int_parser_feed(&p, map.data + pos, len, &arr);
+	}
+	int_parser_finish(&p, &arr);
+	intfile_map_close(&map);
+	unit_check(arr.size == 2 && arr.data[0] == -123456 &&
+		   arr.data[1] == 78, "mapped file in chunks");
+	unlink(map_path);
+	unit_check(intfile_map_open(map_path, &map) != 0, "map no file");
+
+	char path[] = "/tmp/test_intfile_XXXXXX";
+	int fd = mkstemp(path);
+	unit_fail_if(fd < 0);
+	enum { FILE_COUNT = 1000000 };
+	FILE *f = fdopen(fd, "w");
+	for (int i = 0; i < FILE_COUNT; ++i)
+		fprintf(f, "%d ", i * 7 - 1000);
+	fclose(f);
+	arr.size = 0;
+	unit_check(intfile_read(path, &arr) == 0, "read a file");
+	bool is_ok = arr.size == FILE_COUNT;
+	for (int i = 0; i < FILE_COUNT && is_ok; ++i)
+		is_ok = arr.data[i] == i * 7 - 1000;
+	unit_check(is_ok, "file spanning many chunks");
+	unlink(path);
+	unit_check(intfile_read(path, &arr) != 0, "no file");
+
+	/* Write back both ways and read again. */
+	char buf[INTFILE_INT_MAX_LEN + 1];
+	bool is_format_ok = true;
+	for (size_t i = 0; i < count; ++i) {
+		buf[intfile_format_int(expected[i], buf)] = 0;
+		char ref[32];
+		snprintf(ref, sizeof(ref), "%d", expected[i]);
+		is_format_ok = is_format_ok && strcmp(buf, ref) == 0;
+	}
+	for (int v = -100000; v <= 100000 && is_format_ok; v += 7) {
+		buf[intfile_format_int(v, buf)] = 0;
+		is_format_ok = atoi(buf) == v;
+	}
+	unit_check(is_format_ok, "format");
+	int *numbers = malloc(FILE_COUNT * sizeof(int));
+	for (int i = 0; i < FILE_COUNT; ++i)
+		numbers[i] = i % 2 == 0 ? i * 2147 : -i * 2147;
+	unit_check(intfile_write(path, numbers, FILE_COUNT,
+				 INTFILE_TEXT) == 0, "write text");
+	arr.size = 0;
+	unit_fail_if(intfile_read(path, &arr) != 0);
+	unit_check(arr.size == FILE_COUNT && memcmp(arr.data, numbers,
+		   FILE_COUNT * sizeof(int)) == 0, "text round trip");
+	unit_check(intfile_write(path, numbers, FILE_COUNT,
+				 INTFILE_BINARY) == 0, "write binary");
+	struct intfile_map m;
+	unit_fail_if(intfile_map_open(path, &m) != 0);
+	const unsigned char *bytes = (const unsigned char *)m.data;
+	bool is_le = m.size == FILE_COUNT * sizeof(int);
+	for (int i = 0; i < FILE_COUNT && is_le; ++i) {
+		const unsigned char *b = &bytes[i * 4];
+		unsigned v = b[0] | b[1] << 8 | b[2] << 16 | (unsigned)b[3] << 24;
+		is_le = (int)v == numbers[i];
+	}
+	unit_check(is_le, "binary is little-endian int32");
+	intfile_map_close(&m);
+	unlink(path);
+	unit_check(intfile_write("/nonexistent/dir/file", numbers, 1,
+				 INTFILE_TEXT) != 0, "write error");
+	free(numbers);
+	int_array_destroy(&arr);
+
+	unit_test_finish();
+}
+
+static int
+int_cmp(const void *a, const void *b)
+{
+	int x = *(const int *)a, y = *(const int *)b;
+	return x < y ? -1 : x > y;
+}
+
+static bool
+sort_yield_count_f(void *arg)
+{
+	++*(int *)arg;
+	return false;
+}
+
+static void
+test_sort(void)
+{
+	unit_test_start();
+
+	size_t sizes[] = {0, 1, 2, 3, 17, 1000, 100003};
+	enum { MAX_SIZE = 100003 };
+	int *arr = malloc(MAX_SIZE * sizeof(int));
+	int *expected = malloc(MAX_SIZE * sizeof(int));
+	int *scratch = malloc(MAX_SIZE * sizeof(int));
+	const char *names[] = {"merge", "radix", "hybrid"};
+	unit_check(sort_by_name("bogo") == NULL, "unknown engine");
+	for (int e = 0; e < 3; ++e) {
+		sort_f sort = sort_by_name(names[e]);
+		unit_fail_if(sort == NULL);
+		srand(1);
+		int yield_count = 0;
+		bool is_ok = true;
+		for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+			size_t size = sizes[i];
+			/* Duplicates, negatives and the extremes. */
+			for (size_t j = 0; j < size; ++j)
+				arr[j] = rand() % 2000 - 1000;
+			if (size > 2) {
+				arr[0] = INT_MAX;
+				arr[size - 1] = INT_MIN;
+			}
+			memcpy(expected, arr, size * sizeof(int));
+			qsort(expected, size, sizeof(int), int_cmp);
+			sort(arr, size, scratch, sort_yield_count_f,
+			     &yield_count);
+			is_ok = is_ok &&
+				memcmp(arr, expected, size * sizeof(int)) == 0;
+		}
+		unit_msg("engine %s", names[e]);
+		unit_check(is_ok, "sorted");
+		unit_check(yield_count > 0, "the sort yields");
+	}
+
+	/* Runs of all sizes, an empty one too. */
+	enum { RUN_COUNT = 7 };
+	struct sort_run runs[RUN_COUNT];
+	size_t total = 0;
+	int *pos = arr;
+	for (int r = 0; r < RUN_COUNT; ++r) {
+		size_t size = r * r * 100;
+		for (size_t j = 0; j < size; ++j)
+			pos[j] = rand() % 100000 - 50000;
+		sort_merge(pos, size, scratch, NULL, NULL);
+		runs[r] = (struct sort_run){pos, size};
+		pos += size;
+		total += size;
+	}
+	memcpy(expected, arr, total * sizeof(int));
+	qsort(expected, total, sizeof(int), int_cmp);
+	sort_merge_k(runs, RUN_COUNT, scratch);
+	unit_check(memcmp(scratch, expected, total * sizeof(int)) == 0,
+		   "k-way merge");
+	sort_merge_k(runs, 1, scratch);
+	sort_merge_k(runs, 0, scratch);
+
+	/* Heads of the split are the rank smallest numbers. */
+	size_t splits[RUN_COUNT];
+	bool is_split_ok = true;
+	for (size_t rank = 0; rank <= total && is_split_ok; rank += 97) {
+		sort_merge_k_split(runs, RUN_COUNT, rank, splits);
+		size_t taken = 0;
+		for (int r = 0; r < RUN_COUNT; ++r) {
+			taken += splits[r];
+			if (splits[r] > 0 && rank < total &&
+			    runs[r].data[splits[r] - 1] > expected[rank])
+				is_split_ok = false;
+			if (splits[r] < runs[r].size && rank > 0 &&
+			    runs[r].data[splits[r]] < expected[rank - 1])
+				is_split_ok = false;
+		}
+		is_split_ok = is_split_ok && taken == rank;
+	}
+	sort_merge_k_split(runs, RUN_COUNT, total, splits);
+	for (int r = 0; r < RUN_COUNT; ++r)
+		is_split_ok = is_split_ok && splits[r] == runs[r].size;
+	unit_check(is_split_ok, "k-way split");
+
+	free(arr);
+	free(expected);
+	free(scratch);
+
+	unit_test_finish();
+}
+
+static void
+test_extsort(void)
+{
+	unit_test_start();
+
+	/* Two files, the second one is cut short. */
+	enum { COUNT1 = 30000, COUNT2 = 17, COUNT = COUNT1 + COUNT2 };
+	int *expected = malloc(COUNT * sizeof(int));
+	char paths[2][32] = {"/tmp/test_extsort_XXXXXX",
+			     "/tmp/test_extsort_XXXXXX"};
+	srand(3);
+	for (int f = 0, i = 0; f < 2; ++f) {
+		int fd = mkstemp(paths[f]);
+		unit_fail_if(fd < 0);
+		FILE *file = fdopen(fd, "w");
+		for (int end = f == 0 ? COUNT1 : COUNT; i < end; ++i) {
+			expected[i] = rand() % 2000001 - 1000000;
+			fprintf(file, "%d ", expected[i]);
+		}
+		fclose(file);
+	}
+	const char *const path_list[] = {paths[0], paths[1]};
+	struct extsort_reader reader;
+	extsort_reader_create(&reader, path_list, 2);
+
+	enum { RUN_SIZE = 1000 };
+	struct int_array run;
+	run.data = malloc(RUN_SIZE * sizeof(int));
+	run.size = 0;
+	run.capacity = RUN_SIZE;
+	int *scratch = malloc(RUN_SIZE * sizeof(int));
+	/* A run is short of the capacity by one number at most. */
+	struct extsort_run runs[COUNT / (RUN_SIZE - 1) + 1];
+	int run_count = 0;
+	size_t total = 0;
+	bool is_ok = true;
+	while (true) {
+		unit_fail_if(extsort_reader_fill(&reader, &run) != 0);
+		if (run.size == 0)
+			break;
+		is_ok = is_ok && run.capacity == RUN_SIZE &&
+			total + run.size <= COUNT &&
+			memcmp(run.data, &expected[total],
+			       run.size * sizeof(int)) == 0;
+		total += run.size;
+		sort_radix(run.data, run.size, scratch, NULL, NULL);
+		unit_fail_if(extsort_run_spill(run.data, run.size,
+					       &runs[run_count++]) != 0);
+	}
+	extsort_reader_destroy(&reader);
+	unit_check(is_ok && total == COUNT, "runs keep the numbers and order");
+	unit_check(run_count > 2, "input is cut into runs");
+
+	/* The least memory, so the merge takes several passes. */
+	char out_path[] = "/tmp/test_extsort_XXXXXX";
+	int fd = mkstemp(out_path);
+	unit_fail_if(fd < 0);
+	struct intfile_writer out;
+	intfile_writer_create(&out, fd, INTFILE_TEXT);
+	unit_check(extsort_merge(runs, run_count, 0, &out) == 0 &&
+		   intfile_writer_flush(&out) == 0, "merge");
+	intfile_writer_destroy(&out);
+	close(fd);
+	qsort(expected, COUNT, sizeof(int), int_cmp);
+	struct int_array merged;
+	int_array_create(&merged);
+	unit_fail_if(intfile_read(out_path, &merged) != 0);
+	unit_check(merged.size == COUNT && memcmp(merged.data, expected,
+		   COUNT * sizeof(int)) == 0, "merged result");
+	unit_check(extsort_merge(NULL, 0, 0, &out) == 0, "no runs");
+
+	int_array_destroy(&merged);
+	free(run.data);
+	free(scratch);
+	free(expected);
+	unlink(out_path);
+	unlink(paths[0]);
+	unlink(paths[1]);
+
+	unit_test_finish();
+}
+
+static void
+test_pmerge(void)
+{
+	unit_test_start();
+
+	/* Many equal numbers, so the splits cut through them. */
+	enum { RUN_COUNT = 5, RUN_SIZE = 20000, TOTAL = RUN_COUNT * RUN_SIZE };
+	int *data = malloc(TOTAL * sizeof(int));
+	int *expected = malloc(TOTAL * sizeof(int));
+	int *scratch = malloc(RUN_SIZE * sizeof(int));
+	struct sort_run runs[RUN_COUNT];
+	srand(5);
+	for (int r = 0; r < RUN_COUNT; ++r) {
+		int *run = &data[r * RUN_SIZE];
+		size_t size = r == 2 ? 0 : RUN_SIZE;
+		for (size_t i = 0; i < size; ++i)
+			run[i] = rand() % 1000 - 500;
+		sort_radix(run, size, scratch, NULL, NULL);
+		runs[r] = (struct sort_run){run, size};
+	}
+	size_t total = TOTAL - RUN_SIZE;
+	memcpy(expected, data, 2 * RUN_SIZE * sizeof(int));
+	memcpy(&expected[2 * RUN_SIZE], &data[3 * RUN_SIZE],
+	       2 * RUN_SIZE * sizeof(int));
+	qsort(expected, total, sizeof(int), int_cmp);
+
+	char path[] = "/tmp/test_pmerge_XXXXXX";
+	int fd = mkstemp(path);
+	unit_fail_if(fd < 0);
+	close(fd);
+	int thread_counts[] = {1, 2, 3, 8};
+	for (int t = 0; t < 4; ++t) {
+		int threads = thread_counts[t];
+		unit_check(pmerge_write(runs, RUN_COUNT, threads, path,
+					INTFILE_TEXT) == 0, "write text");
+		struct int_array arr;
+		int_array_create(&arr);
+		unit_fail_if(intfile_read(path, &arr) != 0);
+		unit_check(arr.size == total && memcmp(arr.data, expected,
+			   total * sizeof(int)) == 0, "text is merged");
+		int_array_destroy(&arr);
+
+		unit_check(pmerge_write(runs, RUN_COUNT, threads, path,
+					INTFILE_BINARY) == 0, "write binary");
+		struct intfile_map m;
+		unit_fail_if(intfile_map_open(path, &m) != 0);
+		unit_check(m.size == total * sizeof(int) &&
+			   memcmp(m.data, expected, m.size) == 0,
+			   "binary is merged");
+		intfile_map_close(&m);
+	}
+	unit_check(pmerge_write(runs, RUN_COUNT, 4, "/nonexistent/dir/file",
+				INTFILE_TEXT) != 0, "write error");
+	unlink(path);
+	free(scratch);
+	free(expected);
+	free(data);
+
+	unit_test_finish();
+}
+
+int
+main(void)
+{
+	test_basic();
+	test_yield();
+	test_stack();
+	test_stack_pool();
+	test_attr();
+	test_suspend();
+	test_sleep();
+	test_priority();
+	test_profile();
+	test_quantum();
+	test_mt();
+	test_io_pipe();
+	test_io_shared_fd();
+	test_io_socket(false);
+	test_io_socket(true);
+	test_sync(false);
+	test_sync(true);
+	test_intfile();
+	test_sort();
+	test_extsort();
+	test_pmerge();
+	return 0;
+}
@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Cost of starting a command. At first fork() + execv() against
+ * posix_spawn() of /bin/true, while the process has a heap of a
+ * growing size, like a shell with big parser buffers and history.
+ * fork() copies the page tables of all of it, posix_spawn() does
+ * not. The PATH search of posix_spawnp() against the spawn by the
+ * absolute path, which the shell keeps in its command hash. Then
+ * the whole shell on scripts of 1000 lines, which gives
+ * the spawns per second of its launch path, and the commands per
+ * second of the builtins, which are not spawned at all.
+ *
+ * $> make bench
+ * $> ./bench_spawn [shell ...]
+ */
+
+enum {
+	SPAWN_COUNT = 1000,
+	SCRIPT_LINES = 1000,
+};
+
+static double
+now_s(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+run_fork(char **argv)
+{
+	pid_t pid = fork();
+	if (pid == 0) {
+		execv(argv[0], argv);
+		_exit(127);
+	}
+	waitpid(pid, NULL, 0);
+}
+
+static void
+run_spawn(char **argv)
+{
+	pid_t pid;
+	if (posix_spawn(&pid, argv[0], NULL, NULL, argv, environ) == 0)
+		waitpid(pid, NULL, 0);
+}
+
+static void
+bench_start(void)
+{
+	printf("# fork + execv vs posix_spawn of /bin/true, %d runs\n",
+	       SPAWN_COUNT);
+	printf("%10s %14s %14s\n", "heap MB", "fork/s", "spawn/s");
+	char *argv[] = {"/bin/true", NULL};
+	const size_t heap_mb[] = {0, 64, 256, 1024};
+	for (size_t i = 0; i < sizeof(heap_mb) / sizeof(heap_mb[0]); ++i) {
+		size_t size = heap_mb[i] << 20;
+		char *heap = NULL;
+		if (size > 0) {
+			heap = malloc(size);
+			if (heap == NULL)
+				break;
+			/* Touch it, so the pages are really mapped. */
+			memset(heap, 1, size);
+		}
+		double t = now_s();
+		for (int j = 0; j < SPAWN_COUNT; ++j)
+			run_fork(argv);
+		double fork_s = now_s() - t;
+		t = now_s();
+		for (int j = 0; j < SPAWN_COUNT; ++j)
+			run_spawn(argv);
+		double spawn_s = now_s() - t;
+		printf("%10zu %14.0f %14.0f\n", heap_mb[i],
+		       SPAWN_COUNT / fork_s, SPAWN_COUNT / spawn_s);
+		free(heap);
+	}
+}
+
+/**
+ * posix_spawnp() tries execve() in each PATH directory before the
+ * one with the file. The shell's cache gives the absolute path at
+ * once.
+ */
+static void
+bench_path(void)
+{
+	printf("# posix_spawnp vs posix_spawn by path of true, %d runs\n",
+	       SPAWN_COUNT);
+	printf("%10s %14s %14s\n", "PATH dirs", "spawnp/s", "spawn/s");
+	char *argv[] = {"true", NULL};
+	char *old_path = strdup(getenv("PATH") != NULL ? getenv("PATH") : "");
+	const int dir_counts[] = {1, 8, 32};
+	for (size_t i = 0; i < sizeof(dir_counts) / sizeof(dir_counts[0]); ++i) {
+		char path[1024] = "";
+		for (int j = 1; j < dir_counts[i]; ++j)
+			sprintf(path + strlen(path), "/nonexistent/%d:", j);
+		strcat(path, "/bin");
+		setenv("PATH", path, 1);
+		double t = now_s();
+		pid_t pid;
+		for (int j = 0; j < SPAWN_COUNT; ++j) {
+			if (posix_spawnp(&pid, argv[0], NULL, NULL, argv,
+					 environ) == 0)
+				waitpid(pid, NULL, 0);
+		}
+		double spawnp_s = now_s() - t;
+		t = now_s();
+		for (int j = 0; j < SPAWN_COUNT; ++j) {
+			if (posix_spawn(&pid, "/bin/true", NULL, NULL, argv,
+					environ) == 0)
+				waitpid(pid, NULL, 0);
+		}
+		double spawn_s = now_s() - t;
+		printf("%10d %14.0f %14.0f\n", dir_counts[i],
+		       SPAWN_COUNT / spawnp_s, SPAWN_COUNT / spawn_s);
+	}
+	setenv("PATH", old_path, 1);
+	free(old_path);
+}
+
+/** Run the shell with the script as stdin, return seconds. */
+static double
+run_shell(const char *shell, const char *script, size_t size)
+{
+	int fd[2];
+	if (pipe(fd) != 0)
+		abort();
+	double t = now_s();
+	pid_t pid = fork();
+	if (pid == 0) {
+		dup2(fd[0], STDIN_FILENO);
+		close(fd[0]);
+		close(fd[1]);
+		int null_fd = open("/dev/null", O_WRONLY);
+		dup2(null_fd, STDOUT_FILENO);
+		execl(shell, shell, NULL);
+		_exit(127);
+	}
+	close(fd[0]);
+	while (size > 0) {
+		ssize_t rc = write(fd[1], script, size);
+		if (rc <= 0)
+			break;
+		script += rc;
+		size -= rc;
+	}
+	close(fd[1]);
+	int status;
+	waitpid(pid, &status, 0);
+	return now_s() - t;
+}
+
+static void
+bench_shell(const char *shell)
+{
+	static const struct {
+		const char *text;
+		/** Commands in the line. */
+		int count;
+	} lines[] = {
+		{"true\n", 1},
+		{"echo 123\n", 1},
+		{"echo 123 | cat\n", 2},
+		{"/bin/true\n", 1},
+		{"ls /dev/null\n", 1},
+		{"false || true && echo 123\n", 3},
+	};
+	printf("# %s, script of %d lines\n", shell, SCRIPT_LINES);
+	printf("%30s %10s %12s\n", "line", "ms", "commands/s");
+	for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); ++i) {
+		const char *text = lines[i].text;
+		size_t len = strlen(text);
+		char *script = malloc(len * SCRIPT_LINES);
+		for (int j = 0; j < SCRIPT_LINES; ++j)
+			memcpy(script + j * len, text, len);
+		double s = run_shell(shell, script, len * SCRIPT_LINES);
+		char name[32];
+		snprintf(name, sizeof(name), "%.*s", (int)len - 1, text);
+		printf("%30s %10.1f %12.0f\n", name, s * 1000,
+		       lines[i].count * SCRIPT_LINES / s);
+		free(script);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	bench_start();
+	bench_path();
+	if (argc == 1) {
+		bench_shell("./shell");
+		return 0;
+	}
+	for (int i = 1; i < argc; ++i)
+		bench_shell(argv[i]);
+	return 0;
+}
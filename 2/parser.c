@@ -2,13 +2,43 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
+/** A string in the text of the line being parsed. */
+struct text_view {
+	uint32_t offset;
+	uint32_t size;
+};
+
 struct parser {
 	char *buffer;
+	/** Start of the not consumed data. */
+	uint32_t pos;
 	uint32_t size;
 	uint32_t capacity;
+	/**
+	 * Unescaped words of the line being parsed, each one is zero
+	 * terminated. It is copied into the line in one piece when the
+	 * line is complete, and is reused by the next line.
+	 */
+	char *text;
+	uint32_t text_size;
+	uint32_t text_capacity;
+	/** The words of the line being parsed, in order. */
+	struct text_view *words;
+	uint32_t word_count;
+	uint32_t word_capacity;
+	/**
+	 * Draft of the line being parsed. Its exprs are in the array,
+	 * head is not set, tail is the last one. The strings of the
+	 * commands are not set either.
+	 */
+	struct command_line line;
+	struct expr *exprs;
+	uint32_t expr_count;
+	uint32_t expr_capacity;
 };
 
 enum token_type {
@@ -23,82 +53,164 @@ enum token_type {
 	TOKEN_TYPE_BACKGROUND,
 };
 
+/**
+ * The text of a token is not copied anywhere. It is a view of the
+ * parser's text, where its unescaped characters are appended.
+ */
 struct token {
 	enum token_type type;
-	char *data;
+	uint32_t offset;
 	uint32_t size;
-	uint32_t capacity;
 };
 
-static char *
-token_strdup(const struct token *t)
+static void
+parser_text_append(struct parser *p, char c)
 {
-	assert(t->type == TOKEN_TYPE_STR);
-	assert(t->size > 0);
-	char *res = malloc(t->size + 1);
-	memcpy(res, t->data, t->size);
-	res[t->size] = 0;
-	return res;
+	if (p->text_size == p->text_capacity) {
+		p->text_capacity = (p->text_capacity + 1) * 2;
+		p->text = realloc(p->text, sizeof(*p->text) * p->text_capacity);
+	} else {
+		assert(p->text_size < p->text_capacity);
+	}
+	p->text[p->text_size++] = c;
 }
 
 static void
-token_append(struct token *t, char c)
+token_append(struct parser *p, struct token *t, char c)
 {
-	if (t->size == t->capacity) {
-		t->capacity = (t->capacity + 1) * 2;
-		t->data = realloc(t->data, sizeof(*t->data) * t->capacity);
-	} else {
-		assert(t->size < t->capacity);
-	}
-	t->data[t->size++] = c;
+	assert(t->offset + t->size == p->text_size);
+	parser_text_append(p, c);
+	++t->size;
 }
 
 static void
-token_reset(struct token *t)
+token_reset(struct parser *p, struct token *t)
 {
+	t->offset = p->text_size;
 	t->size = 0;
 	t->type = TOKEN_TYPE_NONE;
 }
 
+/** Keep the text of the string token as the next word of the line. */
 static void
-command_append_arg(struct command *cmd, char *arg)
+parser_add_word(struct parser *p, const struct token *t)
 {
-	if (cmd->arg_count == cmd->arg_capacity) {
-		cmd->arg_capacity = (cmd->arg_capacity + 1) * 2;
-		cmd->args = realloc(cmd->args, sizeof(*cmd->args) * cmd->arg_capacity);
-	} else {
-		assert(cmd->arg_count < cmd->arg_capacity);
+	assert(t->type == TOKEN_TYPE_STR);
+	assert(t->size > 0);
+	parser_text_append(p, 0);
+	if (p->word_count == p->word_capacity) {
+		p->word_capacity = (p->word_capacity + 1) * 2;
+		p->words = realloc(p->words,
+				   sizeof(*p->words) * p->word_capacity);
 	}
-	cmd->args[cmd->arg_count++] = arg;
+	p->words[p->word_count].offset = t->offset;
+	p->words[p->word_count].size = t->size;
+	++p->word_count;
 }
 
-void
-command_line_delete(struct command_line *line)
+static void
+parser_add_expr(struct parser *p, enum expr_type type)
 {
-	while (line->head != NULL) {
-		struct expr *e = line->head;
-		if (e->type == EXPR_TYPE_COMMAND) {
-			struct command *cmd = &e->cmd;
-			free(cmd->exe);
-			for (uint32_t i = 0; i < cmd->arg_count; ++i)
-				free(cmd->args[i]);
-			free(cmd->args);
-		}
-		line->head = e->next;
-		free(e);
+	if (p->expr_count == p->expr_capacity) {
+		p->expr_capacity = (p->expr_capacity + 1) * 2;
+		p->exprs = realloc(p->exprs,
+				   sizeof(*p->exprs) * p->expr_capacity);
 	}
-	free(line->out_file);
-	free(line);
+	struct expr *e = &p->exprs[p->expr_count++];
+	memset(e, 0, sizeof(*e));
+	e->type = type;
+	p->line.tail = e;
 }
 
-static void
-command_line_append(struct command_line *line, struct expr *e)
+/**
+ * Bump allocator of a command line. The line, its exprs, the args
+ * arrays and the strings are all cut from one block, sized for them
+ * in advance. The line is at the start of the block, so it is all
+ * freed by one free() of the line.
+ */
+struct line_arena {
+	char *pos;
+	char *end;
+};
+
+/** The pieces are aligned for any of the line's structures. */
+static size_t
+line_arena_align(size_t size)
+{
+	const size_t align = _Alignof(max_align_t);
+	return (size + align - 1) & ~(align - 1);
+}
+
+static void *
+line_arena_alloc(struct line_arena *a, size_t size)
 {
-	if (line->head == NULL)
-		line->head = e;
-	else
-		line->tail->next = e;
-	line->tail = e;
+	char *res = a->pos;
+	assert(res == a->end ||
+	       (uintptr_t)res % _Alignof(max_align_t) == 0);
+	assert(size <= (size_t)(a->end - res));
+	a->pos = res + line_arena_align(size);
+	if (a->pos > a->end)
+		a->pos = a->end;
+	return res;
+}
+
+/**
+ * The line is parsed, move it from the parser into its own arena:
+ * the line, the exprs, then the args of all the commands, then the
+ * text. The commands and the output file point to their words in
+ * the text. Each command takes the exe and then arg_count words.
+ */
+static struct command_line *
+command_line_build(const struct parser *p)
+{
+	uint32_t arg_count = 0;
+	for (uint32_t i = 0; i < p->expr_count; ++i)
+		arg_count += p->exprs[i].cmd.arg_count;
+	size_t size = line_arena_align(sizeof(struct command_line)) +
+		      line_arena_align(sizeof(struct expr) * p->expr_count) +
+		      line_arena_align(sizeof(char *) * arg_count) +
+		      p->text_size;
+	struct line_arena arena;
+	arena.pos = malloc(size);
+	arena.end = arena.pos + size;
+	struct command_line *line = line_arena_alloc(&arena, sizeof(*line));
+	*line = p->line;
+	struct expr *exprs =
+		line_arena_alloc(&arena, sizeof(*exprs) * p->expr_count);
+	char **args = line_arena_alloc(&arena, sizeof(*args) * arg_count);
+	char *text = line_arena_alloc(&arena, p->text_size);
+	assert(arena.pos == arena.end);
+	memcpy(text, p->text, p->text_size);
+
+	const struct text_view *word = p->words;
+	for (uint32_t i = 0; i < p->expr_count; ++i) {
+		struct expr *e = &exprs[i];
+		*e = p->exprs[i];
+		e->next = i + 1 < p->expr_count ? &exprs[i + 1] : NULL;
+		if (e->type != EXPR_TYPE_COMMAND)
+			continue;
+		struct command *cmd = &e->cmd;
+		cmd->exe = text + (word++)->offset;
+		if (cmd->arg_count == 0)
+			continue;
+		cmd->args = args;
+		cmd->arg_capacity = cmd->arg_count;
+		for (uint32_t j = 0; j < cmd->arg_count; ++j)
+			*args++ = text + (word++)->offset;
+	}
+	line->head = &exprs[0];
+	line->tail = &exprs[p->expr_count - 1];
+	if (line->out_type != OUTPUT_TYPE_STDOUT)
+		line->out_file = text + (word++)->offset;
+	assert(word == p->words + p->word_count);
+	return line;
+}
+
+void
+command_line_delete(struct command_line *line)
+{
+	/* All of it is in the arena, which starts with the line. */
+	free(line);
 }
 
 struct parser *
@@ -110,6 +222,15 @@ parser_new(void)
 void
 parser_feed(struct parser *p, const char *str, uint32_t len)
 {
+	if (p->capacity - p->size < len && p->pos > 0) {
+		/*
+		 * The consumed data is dropped only when the room is
+		 * needed, not after each line.
+		 */
+		p->size -= p->pos;
+		memmove(p->buffer, p->buffer + p->pos, p->size);
+		p->pos = 0;
+	}
 	uint32_t cap = p->capacity - p->size;
 	if (cap < len) {
 		uint32_t new_capacity = (p->capacity + 1) * 2;
@@ -126,19 +247,19 @@ parser_feed(struct parser *p, const char *str, uint32_t len)
 static void
 parser_consume(struct parser *p, uint32_t size)
 {
-	assert(p->size >= size);
-	if (size == p->size) {
+	assert(p->size - p->pos >= size);
+	p->pos += size;
+	if (p->pos == p->size) {
+		p->pos = 0;
 		p->size = 0;
-		return;
 	}
-	memmove(p->buffer, p->buffer + size, p->size - size);
-	p->size -= size;
 }
 
 static uint32_t
-parse_token(const char *pos, const char *end, struct token *out)
+parse_token(struct parser *p, const char *pos, const char *end,
+	    struct token *out)
 {
-	token_reset(out);
+	token_reset(p, out);
 	const char *begin = pos;
 	while (pos < end) {
 		if (!isspace(*pos))
@@ -186,7 +307,7 @@ parse_token(const char *pos, const char *end, struct token *out)
 				default:
 					break;
 				}
-				token_append(out, '\\');
+				token_append(p, out, '\\');
 				goto append_and_next;
 			}
 			assert(quote == 0);
@@ -202,9 +323,8 @@ parse_token(const char *pos, const char *end, struct token *out)
 		case '&':
 		case '|':
 		case '>':
-            if(quote == '"'){
-                goto append_and_next;
-            }
+			if (quote != 0)
+				goto append_and_next;
 			if (out->size > 0) {
 				out->type = TOKEN_TYPE_STR;
 				return pos - begin;
@@ -279,7 +399,7 @@ parse_token(const char *pos, const char *end, struct token *out)
 			goto append_and_next;
 		}
 	append_and_next:
-		token_append(out, c);
+		token_append(p, out, c);
 		++pos;
 	}
 	return 0;
@@ -288,29 +408,31 @@ parse_token(const char *pos, const char *end, struct token *out)
 enum parser_error
 parser_pop_next(struct parser *p, struct command_line **out)
 {
-	struct command_line *line = calloc(1, sizeof(*line));
-	char *pos = p->buffer;
+	struct command_line *line = &p->line;
+	char *pos = p->buffer + p->pos;
 	const char *begin = pos;
-	char *end = pos + p->size;
+	char *end = p->buffer + p->size;
 	struct token token = {0};
 	enum parser_error res = PARSER_ERR_NONE;
+	p->text_size = 0;
+	p->word_count = 0;
+	memset(line, 0, sizeof(*line));
+	p->expr_count = 0;
 
 	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
+		uint32_t used = parse_token(p, pos, end, &token);
 		if (used == 0)
 			goto return_no_line;
 		pos += used;
-		struct expr *e;
 		switch(token.type) {
 		case TOKEN_TYPE_STR:
+			/* The strings are set when the line is complete. */
+			parser_add_word(p, &token);
 			if (line->tail != NULL && line->tail->type == EXPR_TYPE_COMMAND) {
-				command_append_arg(&line->tail->cmd, token_strdup(&token));
+				++line->tail->cmd.arg_count;
 				continue;
 			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_COMMAND;
-			e->cmd.exe = token_strdup(&token);
-			command_line_append(line, e);
+			parser_add_expr(p, EXPR_TYPE_COMMAND);
 			continue;
 		case TOKEN_TYPE_NEW_LINE:
 			/* Skip new lines. */
@@ -326,9 +448,7 @@ parser_pop_next(struct parser *p, struct command_line **out)
 				res = PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
 				goto return_error;
 			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_PIPE;
-			command_line_append(line, e);
+			parser_add_expr(p, EXPR_TYPE_PIPE);
 			continue;
 		case TOKEN_TYPE_AND:
 			if (line->tail == NULL) {
@@ -339,9 +459,7 @@ parser_pop_next(struct parser *p, struct command_line **out)
 				res = PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
 				goto return_error;
 			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_AND;
-			command_line_append(line, e);
+			parser_add_expr(p, EXPR_TYPE_AND);
 			continue;
 		case TOKEN_TYPE_OR:
 			if (line->tail == NULL) {
@@ -352,9 +470,7 @@ parser_pop_next(struct parser *p, struct command_line **out)
 				res = PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
 				goto return_error;
 			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_OR;
-			command_line_append(line, e);
+			parser_add_expr(p, EXPR_TYPE_OR);
 			continue;
 		case TOKEN_TYPE_OUT_NEW:
 		case TOKEN_TYPE_OUT_APPEND:
@@ -373,7 +489,7 @@ close_and_return:
 			line->out_type = OUTPUT_TYPE_FILE_NEW;
 		else
 			line->out_type = OUTPUT_TYPE_FILE_APPEND;
-		uint32_t used = parse_token(pos, end, &token);
+		uint32_t used = parse_token(p, pos, end, &token);
 		if (used == 0)
 			goto return_no_line;
 		pos += used;
@@ -381,15 +497,15 @@ close_and_return:
 			res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
 			goto return_error;
 		}
-		line->out_file = token_strdup(&token);
-		used = parse_token(pos, end, &token);
+		parser_add_word(p, &token);
+		used = parse_token(p, pos, end, &token);
 		if (used == 0)
 			goto return_no_line;
 		pos += used;
 	}
 	if (token.type == TOKEN_TYPE_BACKGROUND) {
 		line->is_background = true;
-		uint32_t used = parse_token(pos, end, &token);
+		uint32_t used = parse_token(p, pos, end, &token);
 		if (used == 0)
 			goto return_no_line;
 		pos += used;
@@ -402,8 +518,8 @@ close_and_return:
 			goto return_no_line;
 		}
 		res = PARSER_ERR_NONE;
-		*out = line;
-		goto return_final;
+		*out = command_line_build(p);
+		return res;
 	}
 	res = PARSER_ERR_TOO_LATE_ARGUMENTS;
 	goto return_error;
@@ -414,7 +530,7 @@ return_error:
 	 * just crash here because of that.
 	 */
 	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
+		uint32_t used = parse_token(p, pos, end, &token);
 		if (used == 0)
 			break;
 		pos += used;
@@ -427,11 +543,7 @@ return_error:
 	goto return_no_line;
 
 return_no_line:
-	command_line_delete(line);
 	*out = NULL;
-
-return_final:
-	free(token.data);
 	return res;
 }
 
@@ -439,5 +551,8 @@ void
 parser_delete(struct parser *p)
 {
 	free(p->buffer);
+	free(p->text);
+	free(p->words);
+	free(p->exprs);
 	free(p);
 }
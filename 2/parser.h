@@ -54,6 +54,10 @@ struct command_line {
 	bool is_background;
 };
 
+/**
+ * The line with all its exprs and strings is one block of memory,
+ * so it is freed at once.
+ */
 void
 command_line_delete(struct command_line *line);
 
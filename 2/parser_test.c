@@ -3,6 +3,43 @@
 #include "unit.h"
 
 #include <string.h>
+#include <time.h>
+
+#ifdef PARSER_BENCH
+
+/*
+ * Count all the allocations of the process, for the bench. The
+ * glibc allocator does the work. Only in the bench build, so the
+ * tests run on the real allocator, sanitizers and heap_help too.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static size_t alloc_count = 0;
+
+void *
+malloc(size_t size)
+{
+	++alloc_count;
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t count, size_t size)
+{
+	++alloc_count;
+	return __libc_calloc(count, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	++alloc_count;
+	return __libc_realloc(ptr, size);
+}
+
+#endif /* PARSER_BENCH */
 
 static void
 test_one_word(void)
@@ -819,9 +856,158 @@ test_errors(void)
 	unit_test_finish();
 }
 
+static void
+test_many_lines(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	/*
+	 * The lines are fed in the pieces, which cut the words, and
+	 * several lines are in the buffer at once.
+	 */
+	const char *str = "ls -l /tmp | grep 'a b' > out.txt\n";
+	uint32_t len = strlen(str);
+	const int count = 100;
+	int popped = 0;
+	for (int i = 0; i < count; ++i) {
+		for (uint32_t pos = 0; pos < len; pos += 7) {
+			uint32_t size = len - pos < 7 ? len - pos : 7;
+			parser_feed(p, str + pos, size);
+			if ((i + 1) % 3 != 0 && i + 1 != count)
+				continue;
+			while (true) {
+				unit_fail_if(parser_pop_next(p, &line) !=
+					     PARSER_ERR_NONE);
+				if (line == NULL)
+					break;
+				++popped;
+				struct expr *e = line->head;
+				unit_fail_if(strcmp(e->cmd.exe, "ls") != 0);
+				unit_fail_if(e->cmd.arg_count != 2);
+				unit_fail_if(strcmp(e->cmd.args[1], "/tmp") != 0);
+				e = e->next->next;
+				unit_fail_if(strcmp(e->cmd.exe, "grep") != 0);
+				unit_fail_if(strcmp(e->cmd.args[0], "a b") != 0);
+				unit_fail_if(strcmp(line->out_file, "out.txt") != 0);
+				command_line_delete(line);
+			}
+		}
+	}
+	unit_check(popped == count, "all lines");
+
+	unit_msg("Lines live longer than the next ones");
+	parser_feed(p, "echo 1\necho 2\n", 14);
+	struct command_line *line1 = NULL;
+	struct command_line *line2 = NULL;
+	unit_check(parser_pop_next(p, &line1) == PARSER_ERR_NONE, "parse");
+	unit_check(parser_pop_next(p, &line2) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line1->head->cmd.args[0], "1") == 0, "first");
+	unit_check(strcmp(line2->head->cmd.args[0], "2") == 0, "second");
+	command_line_delete(line1);
+	command_line_delete(line2);
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
+#ifdef PARSER_BENCH
+
+static double
+now_s(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Parse the script fed in pieces of @a chunk bytes, popping all the
+ * complete lines after each piece, like the shell does.
+ */
+static void
+bench_parse(const char *script, size_t size, size_t chunk)
+{
+	size_t allocs = alloc_count;
+	int lines = 0;
+	double t = now_s();
+	struct parser *p = parser_new();
+	for (size_t pos = 0; pos < size; pos += chunk) {
+		size_t len = size - pos < chunk ? size - pos : chunk;
+		parser_feed(p, script + pos, len);
+		struct command_line *line = NULL;
+		while (true) {
+			enum parser_error err = parser_pop_next(p, &line);
+			if (err == PARSER_ERR_NONE && line == NULL)
+				break;
+			unit_fail_if(err != PARSER_ERR_NONE);
+			command_line_delete(line);
+			++lines;
+		}
+	}
+	parser_delete(p);
+	t = now_s() - t;
+	allocs = alloc_count - allocs;
+	printf("%10zu %10zu %10.1f %12.0f %14.2f\n", size >> 10, chunk,
+	       size / t / (1 << 20), lines / t, (double)allocs / lines);
+}
+
+/**
+ * Throughput of the parser on big generated scripts, and how many
+ * allocations each line costs.
+ *
+ * $> make bench_parser
+ */
+static void
+bench_parser(void)
+{
+	static const char *const lines[] = {
+		"echo 'hello world' | grep -v foo >> out.txt\n",
+		"ls -la /tmp /var/tmp && cat file || echo \"no file\"\n",
+		"printf \"%s\\n\" a b c d e f g h | sort | uniq -c\n",
+		"# a comment line\n",
+		"true\n",
+	};
+	const size_t line_count = sizeof(lines) / sizeof(lines[0]);
+	const size_t sizes[] = {1 << 20, 16 << 20};
+	const size_t chunks[] = {1024, 64 * 1024, 0};
+	printf("%10s %10s %10s %12s %14s\n", "script KB", "chunk",
+	       "MB/s", "lines/s", "allocs/line");
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		char *script = malloc(sizes[i]);
+		size_t size = 0;
+		for (size_t j = 0;; ++j) {
+			const char *l = lines[j % line_count];
+			size_t len = strlen(l);
+			if (size + len > sizes[i])
+				break;
+			memcpy(script + size, l, len);
+			size += len;
+		}
+		for (size_t j = 0; j < sizeof(chunks) / sizeof(chunks[0]); ++j) {
+			/* Zero is the whole script in one piece. */
+			size_t chunk = chunks[j] == 0 ? size : chunks[j];
+			bench_parse(script, size, chunk);
+		}
+		free(script);
+	}
+}
+
+#endif /* PARSER_BENCH */
+
 int
-main(void)
+main(int argc, char **argv)
 {
+#ifdef PARSER_BENCH
+	if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+		bench_parser();
+		return 0;
+	}
+#else
+	(void)argc;
+	(void)argv;
+#endif
 	test_one_word();
 	test_incomplete();
 	test_two_words();
@@ -834,5 +1020,6 @@ main(void)
 	test_logical_operators();
 	test_background();
 	test_errors();
+	test_many_lines();
 	return 0;
 }
@@ -1,10 +1,13 @@
+#define _GNU_SOURCE
 #include "parser.h"
 
 #include <assert.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <unistd.h>
 #include "string.h"
 #include "stdlib.h"
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <fcntl.h>
@@ -19,13 +22,6 @@ struct tree_node {
 };
 
 
-struct all_pointer{
-    struct parser * p;
-    struct command_line *l;
-    struct tree_node* t;
-};
-
-
 void node_free(struct tree_node *res) {
     if (res == NULL) return;
     free(res->expr);
@@ -34,42 +30,481 @@ void node_free(struct tree_node *res) {
     free(res);
 }
 
-void all_free(struct all_pointer *a){
-    parser_delete(a->p);
-    command_line_delete(a->l);
-    node_free(a->t);
+/* FNV-1a. */
+static uint32_t
+str_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (; *name != 0; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= 16777619u;
+    }
+    return hash;
 }
 
-int
-command_exec(const struct command *cmd, struct all_pointer *a) {
-    if (strcmp("exit", cmd->exe) == 0) {
-        if(cmd->arg_count > 0){
-            return atoi(cmd->args[0]);
+/*
+ * Shell-wide cache of the PATH search, like the hash of bash. Maps
+ * a command name to its absolute path, so the commands are started
+ * with one execve() instead of trying each PATH directory. The whole
+ * cache is dropped when PATH changes, an entry - when its file does
+ * not start anymore.
+ */
+struct path_entry {
+    char *name;
+    char *path;
+    uint32_t hash;
+    uint32_t hits;
+};
+
+struct path_cache {
+    /* Open addressing, the capacity is a power of 2. */
+    struct path_entry *entries;
+    uint32_t capacity;
+    uint32_t count;
+    /* PATH the entries were found with. */
+    char *path_env;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+static void
+path_cache_create(struct path_cache *cache) {
+    memset(cache, 0, sizeof(*cache));
+}
+
+static void
+path_cache_clear(struct path_cache *cache) {
+    for (uint32_t i = 0; i < cache->capacity; i++) {
+        if (cache->entries[i].name == NULL)
+            continue;
+        free(cache->entries[i].name);
+        free(cache->entries[i].path);
+    }
+    if (cache->capacity > 0)
+        memset(cache->entries, 0, sizeof(cache->entries[0]) * cache->capacity);
+    cache->count = 0;
+}
+
+static void
+path_cache_destroy(struct path_cache *cache) {
+    path_cache_clear(cache);
+    free(cache->entries);
+    free(cache->path_env);
+    memset(cache, 0, sizeof(*cache));
+}
+
+static struct path_entry *
+path_cache_slot(struct path_entry *entries, uint32_t capacity,
+                const char *name, uint32_t hash) {
+    uint32_t slot = hash & (capacity - 1);
+    while (entries[slot].name != NULL &&
+           (entries[slot].hash != hash ||
+            strcmp(entries[slot].name, name) != 0))
+        slot = (slot + 1) & (capacity - 1);
+    return &entries[slot];
+}
+
+static void
+path_cache_insert(struct path_cache *cache, char *name, char *path,
+                  uint32_t hash) {
+    if ((cache->count + 1) * 2 > cache->capacity) {
+        uint32_t capacity = cache->capacity == 0 ? 32 : cache->capacity * 2;
+        struct path_entry *entries = calloc(capacity, sizeof(entries[0]));
+        for (uint32_t i = 0; i < cache->capacity; i++) {
+            struct path_entry *e = &cache->entries[i];
+            if (e->name != NULL)
+                *path_cache_slot(entries, capacity, e->name, e->hash) = *e;
+        }
+        free(cache->entries);
+        cache->entries = entries;
+        cache->capacity = capacity;
+    }
+    struct path_entry *e = path_cache_slot(cache->entries, cache->capacity,
+                                           name, hash);
+    e->name = name;
+    e->path = path;
+    e->hash = hash;
+    e->hits = 0;
+    cache->count++;
+}
+
+/* Drop the entry, the next ones of its probe chain are moved back. */
+static void
+path_cache_forget(struct path_cache *cache, const char *name) {
+    if (cache->count == 0)
+        return;
+    uint32_t mask = cache->capacity - 1;
+    struct path_entry *e = path_cache_slot(cache->entries, cache->capacity,
+                                           name, str_hash(name));
+    if (e->name == NULL)
+        return;
+    free(e->name);
+    free(e->path);
+    e->name = NULL;
+    cache->count--;
+    uint32_t hole = e - cache->entries;
+    for (uint32_t i = (hole + 1) & mask; cache->entries[i].name != NULL;
+         i = (i + 1) & mask) {
+        uint32_t home = cache->entries[i].hash & mask;
+        /* Can not move, if its home slot is in (hole, i]. */
+        if (((i - home) & mask) < ((i - hole) & mask))
+            continue;
+        cache->entries[hole] = cache->entries[i];
+        cache->entries[i].name = NULL;
+        hole = i;
+    }
+}
+
+/* Search PATH like execvp() does. Returns a new string or NULL. */
+static char *
+path_search(const char *name, const char *path_env) {
+    size_t name_len = strlen(name);
+    const char *dir = path_env;
+    while (true) {
+        const char *end = strchrnul(dir, ':');
+        size_t dir_len = end - dir;
+        char *path = malloc(dir_len + name_len + 2);
+        if (dir_len == 0) {
+            /* An empty entry is the current directory. */
+            memcpy(path, name, name_len + 1);
+        } else {
+            memcpy(path, dir, dir_len);
+            path[dir_len] = '/';
+            memcpy(path + dir_len + 1, name, name_len + 1);
+        }
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+            access(path, X_OK) == 0)
+            return path;
+        free(path);
+        if (*end == 0)
+            return NULL;
+        dir = end + 1;
+    }
+}
+
+/*
+ * Absolute path of the command, NULL if there is no such one. Names
+ * with a slash are not searched.
+ */
+static const char *
+path_cache_find(struct path_cache *cache, const char *name) {
+    if (strchr(name, '/') != NULL)
+        return name;
+    const char *path_env = getenv("PATH");
+    if (path_env == NULL)
+        path_env = "/bin:/usr/bin";
+    if (cache->path_env == NULL || strcmp(cache->path_env, path_env) != 0) {
+        path_cache_clear(cache);
+        free(cache->path_env);
+        cache->path_env = strdup(path_env);
+    }
+    uint32_t hash = str_hash(name);
+    if (cache->count > 0) {
+        struct path_entry *e = path_cache_slot(cache->entries,
+                                               cache->capacity, name,
+                                               hash);
+        if (e->name != NULL) {
+            e->hits++;
+            cache->hits++;
+            return e->path;
+        }
+    }
+    cache->misses++;
+    char *path = path_search(name, path_env);
+    if (path == NULL)
+        return NULL;
+    path_cache_insert(cache, strdup(name), path, hash);
+    return path;
+}
+
+/*
+ * Builtins run without a new process: right in the shell, or in a
+ * forked child without exec, when they are a part of a pipeline.
+ * Each one writes to out_fd and returns its exit code. The PATH
+ * cache of the shell is given for hash.
+ */
+typedef int (*builtin_f)(const struct command *cmd, int out_fd,
+                         struct path_cache *cache);
+
+struct builtin {
+    const char *name;
+    builtin_f func;
+};
+
+static int
+write_all(int fd, const char *buf, size_t size) {
+    while (size > 0) {
+        ssize_t rc = write(fd, buf, size);
+        if (rc < 0)
+            return 1;
+        buf += rc;
+        size -= rc;
+    }
+    return 0;
+}
+
+/* Like the coreutils echo: -n, -e and -E flags before the words. */
+static int
+builtin_echo(const struct command *cmd, int out_fd,
+             struct path_cache *cache) {
+    (void) cache;
+    uint32_t i = 0;
+    int newline = 1;
+    int escapes = 0;
+    for (; i < cmd->arg_count; i++) {
+        const char *arg = cmd->args[i];
+        if (arg[0] != '-' || arg[1] == 0 ||
+            arg[strspn(arg + 1, "neE") + 1] != 0)
+            break;
+        for (arg++; *arg != 0; arg++) {
+            if (*arg == 'n')
+                newline = 0;
+            else
+                escapes = *arg == 'e';
+        }
+    }
+    size_t size = 1;
+    for (uint32_t j = i; j < cmd->arg_count; j++)
+        size += strlen(cmd->args[j]) + 1;
+    char *buf = malloc(size);
+    char *pos = buf;
+    for (; i < cmd->arg_count; i++) {
+        const char *arg = cmd->args[i];
+        if (pos != buf)
+            *pos++ = ' ';
+        if (!escapes) {
+            size_t len = strlen(arg);
+            memcpy(pos, arg, len);
+            pos += len;
+            continue;
+        }
+        for (; *arg != 0; arg++) {
+            if (*arg != '\\' || arg[1] == 0) {
+                *pos++ = *arg;
+                continue;
+            }
+            char c = *++arg;
+            const char *from = "abefnrtv\\";
+            const char *to = "\a\b\033\f\n\r\t\v\\";
+            const char *found = strchr(from, c);
+            if (c == 'c') {
+                /* Stop the output here, no newline too. */
+                newline = 0;
+                i = cmd->arg_count;
+                break;
+            } else if (c == '0') {
+                int value = 0;
+                for (int k = 0; k < 3 && arg[1] >= '0' && arg[1] <= '7'; k++)
+                    value = value * 8 + *++arg - '0';
+                *pos++ = (char) value;
+            } else if (found != NULL) {
+                *pos++ = to[found - from];
+            } else {
+                *pos++ = '\\';
+                *pos++ = c;
+            }
         }
+    }
+    if (newline)
+        *pos++ = '\n';
+    int rc = write_all(out_fd, buf, pos - buf);
+    free(buf);
+    return rc;
+}
+
+static int
+builtin_true(const struct command *cmd, int out_fd,
+             struct path_cache *cache) {
+    (void) cache;
+    (void) cmd;
+    (void) out_fd;
+    return 0;
+}
+
+static int
+builtin_false(const struct command *cmd, int out_fd,
+              struct path_cache *cache) {
+    (void) cache;
+    (void) cmd;
+    (void) out_fd;
+    return 1;
+}
+
+static int
+builtin_pwd(const struct command *cmd, int out_fd,
+            struct path_cache *cache) {
+    (void) cache;
+    (void) cmd;
+    char *dir = getcwd(NULL, 0);
+    if (dir == NULL) {
+        perror("pwd");
+        return 1;
+    }
+    size_t len = strlen(dir);
+    dir[len] = '\n';
+    int rc = write_all(out_fd, dir, len + 1);
+    free(dir);
+    return rc;
+}
+
+static int
+builtin_cd(const struct command *cmd, int out_fd,
+           struct path_cache *cache) {
+    (void) cache;
+    (void) out_fd;
+    const char *dir = cmd->arg_count > 0 ? cmd->args[0] : getenv("HOME");
+    if (dir == NULL)
+        return 0;
+    if (chdir(dir) != 0) {
+        perror("cd");
+        return 1;
+    }
+    return 0;
+}
+
+/* The caller stops the shell, if it is not in a pipeline. */
+static int
+builtin_exit(const struct command *cmd, int out_fd,
+             struct path_cache *cache) {
+    (void) cache;
+    (void) out_fd;
+    if(cmd->arg_count > 0){
+        return atoi(cmd->args[0]);
+    }
+    return 0;
+}
+
+/*
+ * hash - the commands found in PATH and how many times each one was
+ * used. -s prints the hits and misses of the cache, -r empties it.
+ */
+static int
+builtin_hash(const struct command *cmd, int out_fd,
+             struct path_cache *cache) {
+    if (cmd->arg_count > 0 && strcmp(cmd->args[0], "-r") == 0) {
+        path_cache_clear(cache);
+        return 0;
+    }
+    if (cmd->arg_count > 0 && strcmp(cmd->args[0], "-s") == 0) {
+        dprintf(out_fd, "hits: %llu, misses: %llu\n",
+                (unsigned long long) cache->hits,
+                (unsigned long long) cache->misses);
+        return 0;
+    }
+    if (cmd->arg_count > 0) {
+        fprintf(stderr, "hash: usage: hash [-r | -s]\n");
+        return 2;
+    }
+    if (cache->count == 0) {
+        dprintf(out_fd, "hash: hash table empty\n");
         return 0;
     }
-    char **args = malloc(sizeof(char *) * (cmd->arg_count + 2));
+    dprintf(out_fd, "hits\tcommand\n");
+    for (uint32_t i = 0; i < cache->capacity; i++) {
+        const struct path_entry *e = &cache->entries[i];
+        if (e->name != NULL)
+            dprintf(out_fd, "%4u\t%s\n", e->hits, e->path);
+    }
+    return 0;
+}
+
+static const struct builtin builtins[] = {
+    {"echo", builtin_echo},
+    {"true", builtin_true},
+    {"false", builtin_false},
+    {"pwd", builtin_pwd},
+    {"cd", builtin_cd},
+    {"exit", builtin_exit},
+    {"hash", builtin_hash},
+};
+
+/*
+ * The builtins are few, so a scan of the table is enough. The first
+ * letters mostly differ, a strcmp is done only when they match.
+ */
+static const struct builtin *
+builtin_find(const char *name) {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (builtins[i].name[0] == name[0] &&
+            strcmp(builtins[i].name, name) == 0)
+            return &builtins[i];
+    }
+    return NULL;
+}
+
+/*
+ * Run the builtin of a pipeline stage in a forked child. There is
+ * nothing to exec, so posix_spawn can not be used here.
+ */
+static pid_t
+builtin_spawn(const struct builtin *b, const struct command *cmd,
+              int in_fd, int out_fd, struct path_cache *cache) {
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+    if (in_fd != STDIN_FILENO)
+        dup2(in_fd, STDIN_FILENO);
+    if (out_fd != STDOUT_FILENO)
+        dup2(out_fd, STDOUT_FILENO);
+    /* The shell's memory is left as is, the child is gone at once. */
+    _exit(b->func(cmd, STDOUT_FILENO, cache));
+}
+
+/*
+ * Start the command with in_fd as stdin and out_fd as stdout. The
+ * executable is taken from the PATH cache. The shell is not forked:
+ * posix_spawn creates the child with vfork semantics, so the page
+ * tables of the shell are not copied, and the fd moves are done in
+ * the child by the file actions. All the other descriptors of the
+ * shell are O_CLOEXEC and do not leak.
+ * Returns pid of the child or -1, if it could not be started.
+ */
+static pid_t
+command_spawn(const struct command *cmd, int in_fd, int out_fd,
+              struct path_cache *cache) {
+    char *args[cmd->arg_count + 2];
     args[0] = cmd->exe;
     for (uint32_t i = 0; i < cmd->arg_count; i++) {
         args[i + 1] = cmd->args[i];
     }
     args[cmd->arg_count + 1] = NULL;
 
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd != STDIN_FILENO)
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    if (out_fd != STDOUT_FILENO)
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    pid_t pid = -1;
+    const char *path = path_cache_find(cache, cmd->exe);
+    if (path != NULL &&
+        posix_spawn(&pid, path, &actions, NULL, args, environ) != 0) {
+        pid = -1;
+        if (path != cmd->exe) {
+            /* The cached file could be removed or moved, search again. */
+            path_cache_forget(cache, cmd->exe);
+            path = path_cache_find(cache, cmd->exe);
+            if (path != NULL &&
+                posix_spawn(&pid, path, &actions, NULL, args, environ) != 0)
+                pid = -1;
+        }
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    return pid;
+}
+
+int
+command_exec(const struct command *cmd, int out_fd, struct path_cache *cache) {
     int status;
     int code=0;
-    pid_t pid = fork();
-    if (pid == 0) {
-        execvp(cmd->exe, args);
-        free(args);
-        all_free(a);
-        exit(0);
-    } else
-        waitpid(pid, &status, WUNTRACED);
+    pid_t pid = command_spawn(cmd, STDIN_FILENO, out_fd, cache);
+    if (pid < 0)
+        return code;
+    waitpid(pid, &status, WUNTRACED);
 
     if(WIFEXITED(status)) {
         code = WEXITSTATUS(status);
     }
-    free(args);
     return code;
 }
 
@@ -125,86 +560,66 @@ struct tree_node *construct_tree(struct expr **expr) {
     return root;
 }
 
-static int  execute_node(struct tree_node *node, struct  all_pointer *a) {
+static int  execute_node(struct tree_node *node, int out_fd,
+                         struct path_cache *cache) {
 
     const struct expr *e = node->expr[0];
     node->exit = 0;
     if (node->cnt > 1) {
-        int pid[node->cnt], status;
-        int fd[node->cnt-1][2];
-
-        for(int i = 0; i < node->cnt - 1; i++){
-            pipe(fd[i]);
-        }
-        for(int i = 0; i < node->cnt -1; i++){
-            pid[i] =fork();
-            if(pid[i] == 0){
-                dup2(fd[i][1], STDOUT_FILENO);
-                if(i > 0){
-                    dup2(fd[i-1][0], STDIN_FILENO);
-                }
-                for(int j = 0; j < node->cnt-1; j++){
-                    close(fd[j][0]);
-                    close(fd[j][1]);
-                }
+        pid_t pid[node->cnt];
+        int status;
+        /* Read end of the previous pipe, stdin of the next stage. */
+        int in_fd = STDIN_FILENO;
 
-                command_exec(&node->expr[i]->cmd, a);
-                close(fd[i][1]);
-                if(i > 0){
-                    close(fd[i-1][0]);
-                }
-                all_free(a);
-                exit(0);
-            } else {
-                close(fd[i][1]);
-                if(i) close(fd[i-1][0]);
+        for(int i = 0; i < node->cnt; i++){
+            const struct command *cmd = &node->expr[i]->cmd;
+            int fd[2] = {-1, out_fd};
+            if(i + 1 < node->cnt){
+                pipe2(fd, O_CLOEXEC);
             }
+            const struct builtin *b = builtin_find(cmd->exe);
+            if (b != NULL)
+                pid[i] = builtin_spawn(b, cmd, in_fd, fd[1], cache);
+            else
+                pid[i] = command_spawn(cmd, in_fd, fd[1], cache);
+            if(i + 1 < node->cnt) close(fd[1]);
+            if(i) close(in_fd);
+            in_fd = fd[0];
         }
-
-        pid[node->cnt-1] = fork();
-        if (pid[node->cnt-1] == 0) {
-            dup2(fd[node->cnt-2][0], STDIN_FILENO);
-            close(fd[node->cnt-2][0]);
-            node->result = command_exec(&node->expr[node->cnt-1]->cmd, a);
-            all_free(a);
-            exit(node->result);
-        }
-        close(fd[node->cnt-2][0]);
         for(int i = 0; i < node->cnt-1; i++) {
-            waitpid(pid[i], NULL, 0);
+            if (pid[i] > 0)
+                waitpid(pid[i], NULL, 0);
+        }
+        if (pid[node->cnt-1] > 0) {
+            waitpid(pid[node->cnt-1], &status, WUNTRACED);
+            node->result = WEXITSTATUS(status);
         }
-        waitpid(pid[node->cnt-1], &status, WUNTRACED);
-        node->result = WEXITSTATUS(status);
 
     } else if (e->type == EXPR_TYPE_AND) {
-        node->result = execute_node(node->left, a);
+        node->result = execute_node(node->left, out_fd, cache);
         node->exit = node->left->exit;
         if (node->exit) return node->result;
         if(node->result == 0) {
-            node->result = execute_node(node->right, a);
+            node->result = execute_node(node->right, out_fd, cache);
             node->exit = node->right->exit;
             if (node->exit) return node->result;
         }
     } else if (e->type == EXPR_TYPE_OR) {
-        node->result = execute_node(node->left, a);
+        node->result = execute_node(node->left, out_fd, cache);
         node->exit = node->left->exit;
         if (node->exit) return node->result;
         if(node->result != 0){
-            node->result = execute_node(node->right, a);
+            node->result = execute_node(node->right, out_fd, cache);
             node->exit = node->right->exit;
             if (node->exit) return node->result;
         }
     } else if (e->type == EXPR_TYPE_COMMAND) {
-        if (strcmp("cd", e->cmd.exe) == 0) {
-            if (e->cmd.arg_count != 0)
-                chdir(e->cmd.args[0]);
-        } else if (strcmp("exit", e->cmd.exe) == 0) {
-            node->exit = 1;
-            if(e->cmd.arg_count > 0){
-                node->result = atoi(e->cmd.args[0]);
-            }
+        const struct builtin *b = builtin_find(e->cmd.exe);
+        if (b != NULL) {
+            node->result = b->func(&e->cmd, out_fd, cache);
+            node->exit = b->func == builtin_exit;
         } else {
-            node->result = command_exec(&e->cmd, a);
+            node->result = command_exec(&e->cmd, out_fd, cache);
         }
     } else {
         assert(false);
@@ -213,42 +628,38 @@ static int  execute_node(struct tree_node *node, struct  all_pointer *a) {
 }
 
 static int
-execute_out_type(struct command_line *line, int * program_result, struct all_pointer* a) {
+execute_out_type(struct command_line *line, int * program_result,
+                 struct path_cache *cache) {
 
     assert(line != NULL);
     int exit;
-    int file;
-    int io;
+    int file = STDOUT_FILENO;
 
+    /*
+     * The shell's own stdout is not touched, the file is given to
+     * the children by the spawn file actions.
+     */
     if (line->out_type == OUTPUT_TYPE_FILE_NEW) {
-        file = open(line->out_file, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600);
-        io = dup(fileno(stdout));
-        dup2(file, fileno(stdout));
+        file = open(line->out_file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
     } else if (line->out_type == OUTPUT_TYPE_FILE_APPEND) {
-        file = open(line->out_file, O_RDWR | O_CREAT | O_APPEND, 0600);
-        io = dup(fileno(stdout));
-        dup2(file, fileno(stdout));
+        file = open(line->out_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
     } else if (line->out_type != OUTPUT_TYPE_STDOUT) {
         assert(false);
     }
+    if (file < 0) {
+        perror(line->out_file);
+        *program_result = 1;
+        return 0;
+    }
 
     struct tree_node *tree = construct_tree(&line->head);
-    (*a).t = tree;
-    execute_node(tree, a);
+    execute_node(tree, file, cache);
     exit = tree->exit;
     *program_result = tree->result;
     node_free(tree);
 
-    if (line->out_type == OUTPUT_TYPE_FILE_NEW) {
+    if (file != STDOUT_FILENO)
         close(file);
-        dup2(io, fileno(stdout));
-        close(io);
-    } else if (line->out_type == OUTPUT_TYPE_FILE_APPEND) {
-        fflush(stdout);
-        close(file);
-        dup2(io, fileno(stdout));
-        close(io);
-    }
     return exit;
 }
 
@@ -260,14 +671,13 @@ main(void) {
     int exit = 0;
     int program_result = 0;
     struct parser *p = parser_new();
-    struct all_pointer a;
-    a.p = p;
+    struct path_cache path_cache;
+    path_cache_create(&path_cache);
     while (!exit && (rc = read(STDIN_FILENO, buf, buf_size)) > 0) {
         parser_feed(p, buf, rc);
         struct command_line *line = NULL;
         while (true) {
             enum parser_error err = parser_pop_next(p, &line);
-            a.l = line;
             if (err == PARSER_ERR_NONE && line == NULL)
                 break;
             if (err != PARSER_ERR_NONE) {
@@ -277,17 +687,19 @@ main(void) {
             if(line->is_background){
                 int pid = fork();
                 if(pid == 0){
-                    exit = execute_out_type(line, &program_result, &a);
+                    exit = execute_out_type(line, &program_result, &path_cache);
                     command_line_delete(line);
                     parser_delete(p);
+                    path_cache_destroy(&path_cache);
                     return exit;
                 }
             } else {
-                exit = execute_out_type(line, &program_result, &a);
+                exit = execute_out_type(line, &program_result, &path_cache);
             }
             command_line_delete(line);
         }
     }
     parser_delete(p);
+    path_cache_destroy(&path_cache);
     return program_result;
 }
\ No newline at end of file
@@ -121,6 +121,7 @@ thread_pool_new(int max_thread_count, struct thread_pool **pool)
     new_pool->threads = malloc(max_thread_count * sizeof (pthread_t));
     new_pool->max_threads = max_thread_count;
     new_pool->cnt_threads = 0;
+    new_pool->run_threads = 0;
     new_pool->shutdown = 0;
 
     new_pool->queue = (struct tasks_queue) {NULL, NULL, 0};
@@ -178,7 +179,9 @@ thread_pool_push_task(struct thread_pool *pool, struct thread_task *task)
     task->delete = false;
     task->finished = false;
 
-    if(pool->cnt_threads < pool->max_threads && pool->cnt_threads == pool->run_threads ) {
+    /* A new thread, if the idle ones can't take all the queued tasks. */
+    if(pool->cnt_threads < pool->max_threads &&
+       pool->queue.cnt > pool->cnt_threads - pool->run_threads) {
         pthread_create(&pool->threads[pool->cnt_threads++], NULL, tpool_worker, pool);
     }
     pthread_cond_signal(&pool->cond);
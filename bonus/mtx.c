@@ -1,6 +1,7 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 typedef long long ll;
@@ -12,46 +13,42 @@ int counter = 0;
 
 
 
-static void assign(double *arr, int *p1, const double *cur, int *p2){
-    arr[*p1] = cur[*p2];
-    (*p1)++;
-    (*p2)++;
-}
-void combine(double *arr, int l, int r){
-    int mid = (l+r)/2;
-    int pointer1 = l;
-    int pointer2 = mid+1, position = 0;
-    double *answer = (double *) malloc((r-l+1) * sizeof (double));
-    while(pointer1 <= mid || pointer2 <= r) {
-        if(pointer1 > mid){
-            assign(answer, &position, arr, &pointer2);
-            continue;
-        }
-        if(pointer2 > r){
-            assign(answer, &position, arr, &pointer1);
-            continue;
-        }
-        if(arr[pointer1] < arr[pointer2]){
-            assign(answer, &position, arr, &pointer1);
+/* Merge sorted src[l, mid) and src[mid, r) into dst[l, r). */
+static void combine(const double *src, double *dst, int l, int mid, int r){
+    int pointer1 = l, pointer2 = mid, position = l;
+    while(pointer1 < mid && pointer2 < r) {
+        if(src[pointer2] < src[pointer1]){
+            dst[position++] = src[pointer2++];
         } else {
-            assign(answer, &position, arr, &pointer2);
+            dst[position++] = src[pointer1++];
         }
     }
-    for(int i = l; i <= r; i++){
-        arr[i] = answer[i-l];
-    }
-    free(answer);
+    while(pointer1 < mid)
+        dst[position++] = src[pointer1++];
+    while(pointer2 < r)
+        dst[position++] = src[pointer2++];
 }
 
+/* Bottom-up merge sort of a[l..r], with one scratch buffer. */
 void sort(double *a, int l, int r){
-    if(l==r) return ;
-    int mid = (l + r) / 2;
-    sort(a, l, mid);
-    sort(a, mid+1, r);
-
-    combine(a, l, r);
+    int n = r - l + 1;
+    double *src = a + l;
+    double *tmp = (double *) malloc(n * sizeof (double));
+    double *dst = tmp;
+    for(int width = 1; width < n; width *= 2){
+        for(int i = 0; i < n; i += 2 * width){
+            int mid = i + width < n ? i + width : n;
+            int end = mid + width < n ? mid + width : n;
+            combine(src, dst, i, mid, end);
+        }
+        double *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if(src != a + l)
+        memcpy(a + l, src, n * sizeof (double));
+    free(tmp);
 }
-
 void * inc(void *arg){
     (void)arg;
     while (counter < NUMS){